@@ -0,0 +1,364 @@
+#include "avtranscoder.hpp"
+
+#ifdef HAVE_LIBAV
+#include <stdexcept>
+#include <cstring>
+#include <syslog.h>
+
+LibavTranscoder::LibavTranscoder(const std::string& path, double startTime)
+: m_in(NULL)
+, m_out(NULL)
+, m_packet(av_packet_alloc())
+, m_offset(0)
+, m_eof(false)
+, m_interrupted(false)
+, m_dst(NULL)
+, m_dst_size(0)
+, m_dst_used(0)
+, m_pending_offset(0)
+{
+	try {
+		m_in = avformat_alloc_context();
+		m_in->interrupt_callback.callback = &LibavTranscoder::_interrupt;
+		m_in->interrupt_callback.opaque = this;
+		if (avformat_open_input(&m_in, path.c_str(), NULL, NULL) < 0)
+			throw std::runtime_error("avformat_open_input failed");
+		if (avformat_find_stream_info(m_in, NULL) < 0)
+			throw std::runtime_error("avformat_find_stream_info failed");
+		if (avformat_alloc_output_context2(&m_out, NULL, "matroska", NULL) < 0)
+			throw std::runtime_error("avformat_alloc_output_context2 failed");
+
+		int video = av_find_best_stream(m_in, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+		int audio = av_find_best_stream(m_in, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+		m_streams.resize(m_in->nb_streams);
+		for (unsigned int i = 0; i < m_in->nb_streams; ++i)
+		{
+			Stream& stream = m_streams[i];
+			memset(&stream, 0, sizeof stream);
+			stream.output = -1;
+			if ((int)i != video && (int)i != audio)
+				continue;
+
+			AVStream* in = m_in->streams[i];
+			AVStream* out = avformat_new_stream(m_out, NULL);
+			stream.output = out->index;
+			if ((int)i == video && in->codecpar->codec_id != AV_CODEC_ID_H264)
+				openVideo(stream, in);
+			else if ((int)i == audio && in->codecpar->codec_id != AV_CODEC_ID_AAC)
+				openAudio(stream, in);
+
+			if (stream.encoder) {
+				avcodec_parameters_from_context(out->codecpar, stream.encoder);
+				out->time_base = stream.encoder->time_base;
+			} else {
+				avcodec_parameters_copy(out->codecpar, in->codecpar);
+				out->codecpar->codec_tag = 0;
+				out->time_base = in->time_base;
+			}
+		}
+
+		if (startTime > 0) {
+			m_offset = startTime * AV_TIME_BASE;
+			if (avformat_seek_file(m_in, -1, INT64_MIN, m_offset, m_offset, 0) < 0)
+				syslog(LOG_DEBUG, "Seeking %s to %.0f failed", path.c_str(), startTime);
+		}
+
+		// payloads bypass the AVIOContext buffer (direct) and go straight
+		// into the response buffer through _write()
+		const int size = 65536;
+		unsigned char* buffer = (unsigned char*)av_malloc(size);
+		m_out->pb = avio_alloc_context(buffer, size, 1, this, NULL, &LibavTranscoder::_write, NULL);
+		m_out->pb->direct = 1;
+		if (avformat_write_header(m_out, NULL) < 0)
+			throw std::runtime_error("avformat_write_header failed");
+	} catch (...) {
+		close();
+		throw;
+	}
+}
+
+LibavTranscoder::~LibavTranscoder()
+{
+	close();
+}
+
+void LibavTranscoder::openVideo(Stream& stream, AVStream* in)
+{
+	const AVCodec* decoder = avcodec_find_decoder(in->codecpar->codec_id);
+	const AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
+	if (!decoder || !encoder)
+		throw std::runtime_error("no h264 encoder or video decoder available");
+
+	stream.decoder = avcodec_alloc_context3(decoder);
+	avcodec_parameters_to_context(stream.decoder, in->codecpar);
+	stream.decoder->pkt_timebase = in->time_base;
+	stream.decoder->thread_count = 0;
+	if (avcodec_open2(stream.decoder, decoder, NULL) < 0)
+		throw std::runtime_error("could not open video decoder");
+
+	stream.encoder = avcodec_alloc_context3(encoder);
+	stream.encoder->width = stream.decoder->width;
+	stream.encoder->height = stream.decoder->height;
+	stream.encoder->sample_aspect_ratio = stream.decoder->sample_aspect_ratio;
+	stream.encoder->pix_fmt = AV_PIX_FMT_YUV420P;
+	stream.encoder->time_base = in->time_base;
+	stream.encoder->framerate = av_guess_frame_rate(m_in, in, NULL);
+	stream.encoder->thread_count = 0;
+	if (m_out->oformat->flags & AVFMT_GLOBALHEADER)
+		stream.encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+	if (avcodec_open2(stream.encoder, encoder, NULL) < 0)
+		throw std::runtime_error("could not open h264 encoder");
+
+	if (stream.decoder->pix_fmt != AV_PIX_FMT_YUV420P) {
+		stream.sws = sws_getContext(stream.decoder->width, stream.decoder->height, stream.decoder->pix_fmt,
+				stream.encoder->width, stream.encoder->height, stream.encoder->pix_fmt,
+				SWS_BILINEAR, NULL, NULL, NULL);
+		stream.frame = av_frame_alloc();
+		stream.frame->format = stream.encoder->pix_fmt;
+		stream.frame->width = stream.encoder->width;
+		stream.frame->height = stream.encoder->height;
+		av_frame_get_buffer(stream.frame, 0);
+	}
+}
+
+void LibavTranscoder::openAudio(Stream& stream, AVStream* in)
+{
+	const AVCodec* decoder = avcodec_find_decoder(in->codecpar->codec_id);
+	const AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_AAC);
+	if (!decoder || !encoder)
+		throw std::runtime_error("no aac encoder or audio decoder available");
+
+	stream.decoder = avcodec_alloc_context3(decoder);
+	avcodec_parameters_to_context(stream.decoder, in->codecpar);
+	stream.decoder->pkt_timebase = in->time_base;
+	if (avcodec_open2(stream.decoder, decoder, NULL) < 0)
+		throw std::runtime_error("could not open audio decoder");
+
+	stream.encoder = avcodec_alloc_context3(encoder);
+	stream.encoder->sample_fmt = AV_SAMPLE_FMT_FLTP;
+	stream.encoder->sample_rate = stream.decoder->sample_rate;
+	av_channel_layout_default(&stream.encoder->ch_layout, stream.decoder->ch_layout.nb_channels);
+	stream.encoder->time_base = av_make_q(1, stream.decoder->sample_rate);
+	if (m_out->oformat->flags & AVFMT_GLOBALHEADER)
+		stream.encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+	if (avcodec_open2(stream.encoder, encoder, NULL) < 0)
+		throw std::runtime_error("could not open aac encoder");
+
+	if (swr_alloc_set_opts2(&stream.swr,
+				&stream.encoder->ch_layout, stream.encoder->sample_fmt, stream.encoder->sample_rate,
+				&stream.decoder->ch_layout, stream.decoder->sample_fmt, stream.decoder->sample_rate,
+				0, NULL) < 0 || swr_init(stream.swr) < 0)
+		throw std::runtime_error("could not create resampler");
+	stream.fifo = av_audio_fifo_alloc(stream.encoder->sample_fmt, stream.encoder->ch_layout.nb_channels, 1);
+	stream.frame = av_frame_alloc();
+	stream.next_pts = AV_NOPTS_VALUE;
+}
+
+void LibavTranscoder::close()
+{
+	for (auto& stream : m_streams) {
+		avcodec_free_context(&stream.decoder);
+		avcodec_free_context(&stream.encoder);
+		sws_freeContext(stream.sws);
+		swr_free(&stream.swr);
+		if (stream.fifo)
+			av_audio_fifo_free(stream.fifo);
+		av_frame_free(&stream.frame);
+	}
+	m_streams.clear();
+	if (m_out) {
+		if (m_out->pb) {
+			av_freep(&m_out->pb->buffer);
+			avio_context_free(&m_out->pb);
+		}
+		avformat_free_context(m_out);
+		m_out = NULL;
+	}
+	avformat_close_input(&m_in);
+	av_packet_free(&m_packet);
+}
+
+ssize_t LibavTranscoder::read(char* buf, size_t max)
+{
+	m_dst = buf;
+	m_dst_size = max;
+	m_dst_used = 0;
+
+	if (m_pending_offset < m_pending.size()) {
+		size_t len = std::min(max, m_pending.size() - m_pending_offset);
+		memcpy(buf, m_pending.data() + m_pending_offset, len);
+		m_pending_offset += len;
+		m_dst_used = len;
+	}
+	if (m_pending_offset == m_pending.size()) {
+		m_pending.clear();
+		m_pending_offset = 0;
+	}
+
+	while (m_dst_used == 0 && !m_eof)
+		if (m_interrupted || !step())
+			return -1;
+
+	m_dst = NULL;
+	return m_dst_used;
+}
+
+void LibavTranscoder::interrupt()
+{
+	m_interrupted = true;
+}
+
+int LibavTranscoder::_interrupt(void* opaque)
+{
+	return static_cast<LibavTranscoder*>(opaque)->m_interrupted ? 1 : 0;
+}
+
+const char* LibavTranscoder::getName() const
+{
+	return "libav";
+}
+
+double LibavTranscoder::getBitrate() const
+{
+	return m_in ? m_in->bit_rate : 0;
+}
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+int LibavTranscoder::_write(void* opaque, const uint8_t* buf, int size)
+#else
+int LibavTranscoder::_write(void* opaque, uint8_t* buf, int size)
+#endif
+{
+	LibavTranscoder* t = static_cast<LibavTranscoder*>(opaque);
+	size_t len = 0;
+	if (t->m_dst && t->m_pending.empty()) {
+		len = std::min((size_t)size, t->m_dst_size - t->m_dst_used);
+		memcpy(t->m_dst + t->m_dst_used, buf, len);
+		t->m_dst_used += len;
+	}
+	if (len < (size_t)size)
+		t->m_pending.append((const char*)buf + len, size - len);
+	return size;
+}
+
+// read and process one packet, at end of file the codecs are drained and the
+// trailer is written
+bool LibavTranscoder::step()
+{
+	int r = av_read_frame(m_in, m_packet);
+	if (r == AVERROR_EOF) {
+		for (size_t i = 0; i < m_streams.size(); ++i) {
+			if (!m_streams[i].decoder)
+				continue;
+			decode(i, NULL);
+			if (m_streams[i].fifo)
+				encodeAudio(i, true);
+			encode(i, NULL);
+		}
+		av_write_trailer(m_out);
+		avio_flush(m_out->pb);
+		m_eof = true;
+		return true;
+	}
+	if (r < 0)
+		return false;
+
+	Stream& stream = m_streams[m_packet->stream_index];
+	if (stream.output != -1) {
+		if (stream.decoder)
+			decode(m_packet->stream_index, m_packet);
+		else
+			write(m_packet->stream_index, m_packet, m_in->streams[m_packet->stream_index]->time_base);
+	}
+	av_packet_unref(m_packet);
+	return true;
+}
+
+void LibavTranscoder::decode(int index, AVPacket* packet)
+{
+	Stream& stream = m_streams[index];
+	AVFrame* frame = av_frame_alloc();
+	avcodec_send_packet(stream.decoder, packet);
+	while (avcodec_receive_frame(stream.decoder, frame) == 0)
+	{
+		frame->pts = frame->best_effort_timestamp;
+		if (stream.fifo) {
+			AVFrame* converted = av_frame_alloc();
+			av_channel_layout_copy(&converted->ch_layout, &stream.encoder->ch_layout);
+			converted->format = stream.encoder->sample_fmt;
+			converted->sample_rate = stream.encoder->sample_rate;
+			if (swr_convert_frame(stream.swr, converted, frame) == 0) {
+				if (stream.next_pts == AV_NOPTS_VALUE && frame->pts != AV_NOPTS_VALUE)
+					stream.next_pts = av_rescale_q(frame->pts - av_rescale_q(m_offset, AV_TIME_BASE_Q,
+								m_in->streams[index]->time_base), m_in->streams[index]->time_base,
+							stream.encoder->time_base);
+				av_audio_fifo_write(stream.fifo, (void**)converted->data, converted->nb_samples);
+			}
+			av_frame_free(&converted);
+			encodeAudio(index, false);
+		} else {
+			if (frame->pts != AV_NOPTS_VALUE)
+				frame->pts -= av_rescale_q(m_offset, AV_TIME_BASE_Q, m_in->streams[index]->time_base);
+			if (stream.sws) {
+				av_frame_make_writable(stream.frame);
+				sws_scale(stream.sws, frame->data, frame->linesize, 0, frame->height,
+						stream.frame->data, stream.frame->linesize);
+				stream.frame->pts = frame->pts;
+				encode(index, stream.frame);
+			} else
+				encode(index, frame);
+		}
+		av_frame_unref(frame);
+	}
+	av_frame_free(&frame);
+}
+
+// feed the encoder with full frames from the audio fifo (and whatever is
+// left when flushing)
+void LibavTranscoder::encodeAudio(int index, bool flush)
+{
+	Stream& stream = m_streams[index];
+	int frameSize = stream.encoder->frame_size;
+	while (av_audio_fifo_size(stream.fifo) >= frameSize ||
+			(flush && av_audio_fifo_size(stream.fifo) > 0))
+	{
+		av_frame_unref(stream.frame);
+		stream.frame->nb_samples = std::min(frameSize, av_audio_fifo_size(stream.fifo));
+		av_channel_layout_copy(&stream.frame->ch_layout, &stream.encoder->ch_layout);
+		stream.frame->format = stream.encoder->sample_fmt;
+		stream.frame->sample_rate = stream.encoder->sample_rate;
+		av_frame_get_buffer(stream.frame, 0);
+		av_audio_fifo_read(stream.fifo, (void**)stream.frame->data, stream.frame->nb_samples);
+		stream.frame->pts = stream.next_pts == AV_NOPTS_VALUE ? 0 : stream.next_pts;
+		stream.next_pts = stream.frame->pts + stream.frame->nb_samples;
+		encode(index, stream.frame);
+	}
+}
+
+void LibavTranscoder::encode(int index, AVFrame* frame)
+{
+	Stream& stream = m_streams[index];
+	AVPacket* packet = av_packet_alloc();
+	avcodec_send_frame(stream.encoder, frame);
+	while (avcodec_receive_packet(stream.encoder, packet) == 0)
+		write(index, packet, stream.encoder->time_base);
+	av_packet_free(&packet);
+}
+
+void LibavTranscoder::write(int index, AVPacket* packet, AVRational timeBase)
+{
+	Stream& stream = m_streams[index];
+	AVStream* out = m_out->streams[stream.output];
+	if (!stream.encoder && m_offset) {
+		int64_t offset = av_rescale_q(m_offset, AV_TIME_BASE_Q, timeBase);
+		if (packet->pts != AV_NOPTS_VALUE)
+			packet->pts -= offset;
+		if (packet->dts != AV_NOPTS_VALUE)
+			packet->dts -= offset;
+	}
+	av_packet_rescale_ts(packet, timeBase, out->time_base);
+	packet->stream_index = stream.output;
+	packet->pos = -1;
+	av_interleaved_write_frame(m_out, packet);
+}
+#endif
@@ -0,0 +1,72 @@
+#ifndef _AVTRANSCODER_HPP_
+#define _AVTRANSCODER_HPP_
+
+#include "transcoder.hpp"
+#include <atomic>
+
+#ifdef HAVE_LIBAV
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/audio_fifo.h>
+#include <libswscale/swscale.h>
+#include <libswresample/swresample.h>
+}
+
+// remuxes (and transcodes video to h264 and audio to aac when needed) in
+// process using libavformat/libavcodec. the muxer output is written straight
+// into the buffer passed to read(), only what doesn't fit is kept aside.
+class LibavTranscoder : public Transcoder {
+	public:
+		LibavTranscoder(const std::string& path, double startTime);
+		~LibavTranscoder();
+
+		ssize_t read(char* buf, size_t max);
+		void interrupt();
+		const char* getName() const;
+		double getBitrate() const;
+	private:
+		struct Stream {
+			int output;
+			AVCodecContext* decoder;
+			AVCodecContext* encoder;
+			SwsContext* sws;
+			SwrContext* swr;
+			AVAudioFifo* fifo;
+			AVFrame* frame;
+			int64_t next_pts;
+		};
+
+		void openVideo(Stream& stream, AVStream* in);
+		void openAudio(Stream& stream, AVStream* in);
+		bool step();
+		void decode(int index, AVPacket* packet);
+		void encode(int index, AVFrame* frame);
+		void encodeAudio(int index, bool flush);
+		void write(int index, AVPacket* packet, AVRational timeBase);
+		void close();
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+		static int _write(void* opaque, const uint8_t* buf, int size);
+#else
+		static int _write(void* opaque, uint8_t* buf, int size);
+#endif
+		static int _interrupt(void* opaque);
+
+		AVFormatContext* m_in;
+		AVFormatContext* m_out;
+		AVPacket* m_packet;
+		std::vector<Stream> m_streams;
+		int64_t m_offset;
+		bool m_eof;
+		std::atomic<bool> m_interrupted;
+
+		char* m_dst;
+		size_t m_dst_size;
+		size_t m_dst_used;
+		std::string m_pending;
+		size_t m_pending_offset;
+};
+#endif
+
+#endif
@@ -0,0 +1,245 @@
+#include "charset.hpp"
+#include <iconv.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+static size_t asciiScalar(const unsigned char* p, size_t n)
+{
+	size_t i = 0;
+	while (i < n && p[i] < 0x80)
+		++i;
+	return i;
+}
+
+#if defined(__SSE2__)
+static size_t asciiSSE2(const unsigned char* p, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(p + i)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + asciiScalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t asciiAVX2(const unsigned char* p, size_t n)
+{
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		unsigned int mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)(p + i)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + asciiSSE2(p + i, n - i);
+}
+#elif defined(__aarch64__)
+static size_t asciiNEON(const unsigned char* p, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		if (vmaxvq_u8(vld1q_u8(p + i)) >= 0x80)
+			return i + asciiScalar(p + i, 16);
+	}
+	return i + asciiScalar(p + i, n - i);
+}
+#endif
+
+// the number of leading ASCII bytes
+static size_t asciiPrefix(const unsigned char* p, size_t n)
+{
+#if defined(__SSE2__)
+	static const bool avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+	return avx2 ? asciiAVX2(p, n) : asciiSSE2(p, n);
+#elif defined(__aarch64__)
+	return asciiNEON(p, n);
+#else
+	return asciiScalar(p, n);
+#endif
+}
+
+bool charset_is_utf8(const char* data, size_t len)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	const unsigned char* end = p + len;
+	while (p < end)
+	{
+		p += asciiPrefix(p, end - p);
+		if (p >= end)
+			break;
+
+		// reject overlong forms, surrogates and anything above U+10FFFF
+		size_t n;
+		unsigned char min = 0x80, max = 0xbf;
+		if (*p >= 0xc2 && *p <= 0xdf)
+			n = 2;
+		else if (*p >= 0xe0 && *p <= 0xef) {
+			n = 3;
+			if (*p == 0xe0)
+				min = 0xa0;
+			if (*p == 0xed)
+				max = 0x9f;
+		} else if (*p >= 0xf0 && *p <= 0xf4) {
+			n = 4;
+			if (*p == 0xf0)
+				min = 0x90;
+			if (*p == 0xf4)
+				max = 0x8f;
+		} else
+			return false;
+		if ((size_t)(end - p) < n)
+			return false;
+		if (p[1] < min || p[1] > max)
+			return false;
+		for (size_t i = 2; i < n; ++i)
+			if ((p[i] & 0xc0) != 0x80)
+				return false;
+		p += n;
+	}
+	return true;
+}
+
+// the 8-bit Latin encodings differ in 0x80-0xbf: which bytes are letters,
+// and which are undefined (or C1 controls, which never appear in text)
+struct Latin {
+	const char* name;
+	bool c1;
+	const char* letters;
+	const char* undefined;
+};
+
+static const Latin latins[] = {
+	{ "ISO-8859-1", false, "\xaa\xba", "" },
+	{ "ISO-8859-2", false, "\xa1\xa3\xa5\xa6\xa9\xaa\xab\xac\xae\xaf\xb1\xb3\xb5\xb6\xb9\xba\xbb\xbc\xbe\xbf", "" },
+	{ "CP1252", true, "\x83\x8a\x8c\x8e\x9a\x9c\x9e\x9f\xaa\xba", "\x81\x8d\x8f\x90\x9d" },
+	{ "CP1250", true, "\x8a\x8c\x8d\x8e\x8f\x9a\x9c\x9d\x9e\x9f\xa3\xa5\xaa\xaf\xb3\xb9\xba\xbc\xbe\xbf", "\x81\x83\x88\x90\x98" },
+};
+
+static int latinScore(const Latin& latin, const unsigned int* counts)
+{
+	int score = 0;
+	for (unsigned int c = 0x80; c < 0xc0; ++c)
+	{
+		if (!counts[c])
+			continue;
+		if ((c < 0xa0 && !latin.c1) || strchr(latin.undefined, c))
+			score -= 5 * counts[c];
+		else if (strchr(latin.letters, c))
+			score += counts[c];
+	}
+	return score;
+}
+
+std::string charset_detect(const std::string& data)
+{
+	const unsigned char* p = (const unsigned char*)data.data();
+	size_t len = data.size();
+
+	if (len >= 3 && p[0] == 0xef && p[1] == 0xbb && p[2] == 0xbf)
+		return "UTF-8";
+	if (len >= 2 && ((p[0] == 0xff && p[1] == 0xfe) || (p[0] == 0xfe && p[1] == 0xff)))
+		return "UTF-16";
+
+	// text in UTF-16 without a BOM has every other byte zero
+	size_t sample = std::min(len, (size_t)4096) & ~(size_t)1;
+	if (sample) {
+		size_t even = 0, odd = 0;
+		for (size_t i = 0; i < sample; i += 2) {
+			even += p[i] == 0;
+			odd += p[i + 1] == 0;
+		}
+		if (odd > sample / 4 && even <= sample / 40)
+			return "UTF-16LE";
+		if (even > sample / 4 && odd <= sample / 40)
+			return "UTF-16BE";
+	}
+
+	if (charset_is_utf8(data.data(), len))
+		return "UTF-8";
+
+	unsigned int counts[256] = { 0 };
+	size_t letters = 0;
+	for (size_t i = 0; i < len; ++i) {
+		counts[p[i]]++;
+		letters += (p[i] | 0x20) >= 'a' && (p[i] | 0x20) <= 'z';
+	}
+	size_t high = 0, c1 = 0, upper = 0, lower = 0;
+	for (unsigned int c = 0x80; c < 0x100; ++c) {
+		high += counts[c];
+		if (c < 0xa0)
+			c1 += counts[c];
+		else if (c >= 0xc0 && c < 0xe0)
+			upper += counts[c];
+		else if (c >= 0xe0)
+			lower += counts[c];
+	}
+
+	// in Cyrillic text (nearly) every letter is a high byte, and most of them
+	// are lower case: 0xe0-0xff in CP1251 but 0xc0-0xdf in KOI8-R
+	if (high > letters)
+		return lower >= upper ? "CP1251" : "KOI8-R";
+
+	// the Latin encodings score by the letters they make of 0x80-0xbf, ties
+	// go to ISO-8859 unless there are bytes only the CP125x encodings use
+	const Latin* best = NULL;
+	int bestScore = 0;
+	for (auto& latin : latins)
+	{
+		int score = latinScore(latin, counts);
+		if (!best || score > bestScore || (score == bestScore && c1 && latin.c1 && !best->c1)) {
+			best = &latin;
+			bestScore = score;
+		}
+	}
+	return best->name;
+}
+
+std::string charset_to_utf8(const std::string& data, const std::string& charset)
+{
+	if (charset == "UTF-8") {
+		if (data.compare(0, 3, "\xef\xbb\xbf") == 0)
+			return data.substr(3);
+		return data;
+	}
+
+	iconv_t cd = iconv_open("UTF-8", charset.c_str());
+	if (cd == (iconv_t)-1)
+		throw std::runtime_error("unsupported charset: " + charset);
+
+	std::string out;
+	char buf[8192];
+	char* in = (char*)data.data();
+	size_t inleft = data.size();
+	while (inleft > 0)
+	{
+		char* o = buf;
+		size_t oleft = sizeof buf;
+		size_t r = iconv(cd, &in, &inleft, &o, &oleft);
+		out.append(buf, o - buf);
+		if (r == (size_t)-1) {
+			if (errno == E2BIG)
+				continue;
+			// skip what can't be converted
+			if (errno == EILSEQ) {
+				++in;
+				--inleft;
+				continue;
+			}
+			break;
+		}
+	}
+	iconv_close(cd);
+
+	if (out.compare(0, 3, "\xef\xbb\xbf") == 0)
+		out.erase(0, 3);
+	return out;
+}
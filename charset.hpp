@@ -0,0 +1,17 @@
+#ifndef _CHARSET_HPP_
+#define _CHARSET_HPP_
+
+#include <string>
+
+// true if data is valid UTF-8 (ASCII runs are skipped with SIMD)
+bool charset_is_utf8(const char* data, size_t len);
+
+// guess the charset of text: UTF-8, UTF-16LE/BE (with or without BOM), or
+// one of the common 8-bit encodings (Western, Central European or Cyrillic)
+std::string charset_detect(const std::string& data);
+
+// convert data from charset to UTF-8 (a BOM is dropped), bytes that can't
+// be converted are skipped
+std::string charset_to_utf8(const std::string& data, const std::string& charset);
+
+#endif
@@ -348,6 +348,23 @@ void ChromeCast::_read()
 				{
 					Json::Value& status = response["status"][0u];
 					m_media_session_id = status["mediaSessionId"].asUInt();
+
+					// the receiver's queue, to find items by uuid
+					std::lock_guard<std::mutex> lock(m_queue_mutex);
+					if (status.isMember("items")) {
+						// items are not always sent with their media
+						std::map<unsigned int, std::string> items;
+						for (auto& item : status["items"]) {
+							unsigned int id = item["itemId"].asUInt();
+							std::string uuid = item["media"]["customData"]["uuid"].asString();
+							items[id] = uuid.empty() ? m_queue_items[id] : uuid;
+						}
+						m_queue_items.swap(items);
+					}
+					if (status.isMember("currentItemId") &&
+							!status["media"]["customData"]["uuid"].asString().empty())
+						m_queue_items[status["currentItemId"].asUInt()] =
+							status["media"]["customData"]["uuid"].asString();
 				}
 			}
 		}
@@ -373,8 +390,11 @@ void ChromeCast::_read()
 				{
 					std::string uuid = m_uuid;
 					Json::Value& status = response["status"][0u];
-					if (status.isMember("activeTrackIds"))
+					if (status.isMember("activeTrackIds")) {
 						m_subtitles = status["activeTrackIds"].isValidIndex(0u);
+						if (m_subtitles)
+							m_subtitle_track = status["activeTrackIds"][0u].asUInt();
+					}
 					m_volume = status["volume"]["level"].asDouble();
 					m_muted = status["volume"]["muted"].asBool();
 					m_player_state = status["playerState"].asString();
@@ -410,6 +430,15 @@ const std::string& ChromeCast::getUUID() const
 	return m_uuid;
 }
 
+unsigned int ChromeCast::getItemId(const std::string& uuid) const
+{
+	std::lock_guard<std::mutex> lock(m_queue_mutex);
+	for (auto& item : m_queue_items)
+		if (item.second == uuid)
+			return item.first;
+	return 0;
+}
+
 const std::string& ChromeCast::getPlayerState() const
 {
 	return m_player_state;
@@ -427,6 +456,11 @@ bool ChromeCast::hasSubtitles() const
 	return m_subtitles;
 }
 
+unsigned int ChromeCast::getSubtitleTrack() const
+{
+	return m_subtitle_track;
+}
+
 std::string ChromeCast::getSocketName() const
 {
 	struct sockaddr_in addr;
@@ -450,7 +484,39 @@ bool isPlayerState(const Json::Value& response, const std::string& playerState)
 	return false;
 }
 
-bool ChromeCast::load(const std::string& url, const std::string& title, const std::string& uuid)
+Json::Value mediaInformation(const ChromeCast::Media& media)
+{
+	Json::Value info;
+	info["contentId"] = media.url;
+	info["streamType"] = "buffered";
+	info["contentType"] = media.contentType;
+	if (!media.segmentFormat.empty()) {
+		info["hlsSegmentFormat"] = media.segmentFormat;
+		info["hlsVideoSegmentFormat"] = media.segmentFormat;
+	}
+	info["customData"]["uuid"] = media.uuid;
+	info["metadata"]["title"] = media.title;
+	info["tracks"] = Json::arrayValue;
+	for (size_t i = 0; i < media.textTracks.size(); ++i)
+	{
+		Json::Value track;
+		track["language"] = media.textTracks[i].language;
+		track["name"] = media.textTracks[i].name;
+		track["type"] = "TEXT";
+		track["subtype"] = "SUBTITLES";
+		track["trackId"] = (unsigned int)i + 1;
+		track["trackContentId"] = media.textTracks[i].url;
+		track["trackContentType"] = "text/vtt";
+		info["tracks"].append(track);
+	}
+	info["textTrackStyle"]["backgroundColor"] = "#00000000";
+	info["textTrackStyle"]["edgeType"] = "OUTLINE";
+	info["textTrackStyle"]["edgeColor"] = "#000000FF";
+	info["textTrackStyle"]["fontScale"] = 1.1;
+	return info;
+}
+
+bool ChromeCast::load(const Media& media)
 {
 	if (!m_init && !init())
 		return false;
@@ -458,35 +524,100 @@ bool ChromeCast::load(const std::string& url, const std::string& title, const st
 	msg["type"] = "LOAD";
 	msg["requestId"] = _request_id();
 	msg["sessionId"] = m_session_id;
-	msg["media"]["contentId"] = url;
-	msg["media"]["streamType"] = "buffered";
-	msg["media"]["contentType"] = "video/x-matroska";
-	msg["media"]["customData"]["uuid"] = uuid;
-	msg["media"]["metadata"]["title"] = title;
-	msg["media"]["tracks"] = Json::arrayValue;
-	msg["media"]["tracks"][0] = Json::objectValue;
-	msg["media"]["tracks"][0]["language"] = "en-US";
-	msg["media"]["tracks"][0]["name"] = "English";
-	msg["media"]["tracks"][0]["type"] = "TEXT";
-	msg["media"]["tracks"][0]["subtype"] = "SUBTITLES";
-	msg["media"]["tracks"][0]["trackId"] = 1;
-	msg["media"]["tracks"][0]["trackContentId"] = "trk0002";
-	msg["media"]["tracks"][0]["trackContentId"] = std::string(url).replace(std::string(url).find("stream/"), 6, "subs");
-	msg["media"]["tracks"][0]["trackContentType"] = "text/vtt";
-	msg["media"]["textTrackStyle"]["backgroundColor"] = "#00000000";
-	msg["media"]["textTrackStyle"]["edgeType"] = "OUTLINE";
-	msg["media"]["textTrackStyle"]["edgeColor"] = "#000000FF";
-	msg["media"]["textTrackStyle"]["fontScale"] = 1.1;
-	if (m_subtitles) {
-		msg["activeTrackIds"] = Json::arrayValue;
-		msg["activeTrackIds"][0] = 1;
-	}
+	msg["media"] = mediaInformation(media);
+	if (m_subtitles && !media.textTracks.empty())
+		msg["activeTrackIds"] = activeTrackIds(media);
 	msg["autoplay"] = true;
-	msg["currentTime"] = 0;
+	msg["currentTime"] = media.currentTime;
+	response = send("urn:x-cast:com.google.cast.media", msg);
+	return isPlayerState(response, "BUFFERING") || isPlayerState(response, "PLAYING");
+}
+
+Json::Value ChromeCast::queueItems(const std::vector<Media>& items, double preloadTime) const
+{
+	Json::Value json(Json::arrayValue);
+	for (auto& media : items)
+	{
+		Json::Value item;
+		item["media"] = mediaInformation(media);
+		item["autoplay"] = true;
+		item["startTime"] = media.currentTime;
+		item["preloadTime"] = preloadTime;
+		if (m_subtitles && !media.textTracks.empty())
+			item["activeTrackIds"] = activeTrackIds(media);
+		json.append(item);
+	}
+	return json;
+}
+
+// keep the selected subtitle track, if the media has that many
+Json::Value ChromeCast::activeTrackIds(const Media& media) const
+{
+	Json::Value ids(Json::arrayValue);
+	ids.append(m_subtitle_track <= media.textTracks.size() ? m_subtitle_track : 1);
+	return ids;
+}
+
+// the receiver plays the items in order, and starts buffering the next item
+// preloadTime seconds before the current one ends
+bool ChromeCast::queueLoad(const std::vector<Media>& items, double preloadTime)
+{
+	if (!m_init && !init())
+		return false;
+	Json::Value msg, response;
+	msg["type"] = "QUEUE_LOAD";
+	msg["requestId"] = _request_id();
+	msg["sessionId"] = m_session_id;
+	msg["items"] = queueItems(items, preloadTime);
+	msg["startIndex"] = 0;
+	msg["repeatMode"] = "REPEAT_OFF";
 	response = send("urn:x-cast:com.google.cast.media", msg);
 	return isPlayerState(response, "BUFFERING") || isPlayerState(response, "PLAYING");
 }
 
+// append items to the end of the queue
+bool ChromeCast::queueInsert(const std::vector<Media>& items, double preloadTime)
+{
+	if (!m_init && !init())
+		return false;
+	Json::Value msg, response;
+	msg["type"] = "QUEUE_INSERT";
+	msg["requestId"] = _request_id();
+	msg["mediaSessionId"] = m_media_session_id;
+	msg["items"] = queueItems(items, preloadTime);
+	response = send("urn:x-cast:com.google.cast.media", msg);
+	return response["type"].asString() == "MEDIA_STATUS";
+}
+
+bool ChromeCast::queueRemove(const std::vector<unsigned int>& itemIds)
+{
+	if (!m_init && !init())
+		return false;
+	Json::Value msg, response;
+	msg["type"] = "QUEUE_REMOVE";
+	msg["requestId"] = _request_id();
+	msg["mediaSessionId"] = m_media_session_id;
+	msg["itemIds"] = Json::arrayValue;
+	for (auto id : itemIds)
+		msg["itemIds"].append(id);
+	response = send("urn:x-cast:com.google.cast.media", msg);
+	return response["type"].asString() == "MEDIA_STATUS";
+}
+
+// skip jump items ahead (or back) in the queue
+bool ChromeCast::queueUpdate(int jump)
+{
+	if (!m_init && !init())
+		return false;
+	Json::Value msg, response;
+	msg["type"] = "QUEUE_UPDATE";
+	msg["requestId"] = _request_id();
+	msg["mediaSessionId"] = m_media_session_id;
+	msg["jump"] = jump;
+	response = send("urn:x-cast:com.google.cast.media", msg);
+	return response["type"].asString() == "MEDIA_STATUS";
+}
+
 bool ChromeCast::pause()
 {
 	if (!m_init && !init())
@@ -523,7 +654,8 @@ bool ChromeCast::stop()
 	return isPlayerState(response, "IDLE");
 }
 
-bool ChromeCast::setSubtitles(bool status)
+// trackId 0 turns subtitles off
+bool ChromeCast::setSubtitles(unsigned int trackId)
 {
 	if (!m_init && !init())
 		return false;
@@ -532,8 +664,8 @@ bool ChromeCast::setSubtitles(bool status)
 	msg["requestId"] = _request_id();
 	msg["mediaSessionId"] = m_media_session_id;
 	msg["activeTrackIds"] = Json::arrayValue;
-	if (status)
-		msg["activeTrackIds"][0] = 1;
+	if (trackId)
+		msg["activeTrackIds"][0] = trackId;
 	response = send("urn:x-cast:com.google.cast.media", msg);
 	return true;
 }
@@ -6,20 +6,40 @@
 #include <thread>
 #include <string>
 #include <map>
+#include <vector>
 
 class ChromeCast {
 	public:
+		struct TextTrack {
+			std::string url;
+			std::string language = "en-US";
+			std::string name = "English";
+		};
+		struct Media {
+			std::string url;
+			std::vector<TextTrack> textTracks;
+			std::string contentType = "video/x-matroska";
+			std::string segmentFormat;
+			std::string title;
+			std::string uuid;
+			double currentTime = 0;
+		};
+
 		ChromeCast(const std::string& ip);
 		~ChromeCast();
 		bool init();
 
 		void setMediaStatusCallback(std::function<void(const std::string&,
 					const std::string&, const std::string&)> func);
-		bool load(const std::string& url, const std::string& title, const std::string& uuid);
+		bool load(const Media& media);
+		bool queueLoad(const std::vector<Media>& items, double preloadTime);
+		bool queueInsert(const std::vector<Media>& items, double preloadTime);
+		bool queueRemove(const std::vector<unsigned int>& itemIds);
+		bool queueUpdate(int jump);
 		bool play();
 		bool pause();
 		bool stop();
-		bool setSubtitles(bool status);
+		bool setSubtitles(unsigned int trackId);
 		bool setVolume(double level);
 		bool setMuted(bool muted);
 		double getVolume() const;
@@ -27,9 +47,11 @@ class ChromeCast {
 		void setSubtitleSettings(bool status);
 
 		const std::string& getUUID() const;
+		unsigned int getItemId(const std::string& uuid) const;
 		const std::string& getPlayerState() const;
 		double getPlayerCurrentTime() const;
 		bool hasSubtitles() const;
+		unsigned int getSubtitleTrack() const;
 		std::string getSocketName() const;
 	private:
 		bool connect();
@@ -38,6 +60,8 @@ class ChromeCast {
 		Json::Value send(const std::string& namespace_, const Json::Value& payload, const std::string& destination_id = "");
 		void _read();
 		void _release_waiters();
+		Json::Value queueItems(const std::vector<Media>& items, double preloadTime) const;
+		Json::Value activeTrackIds(const Media& media) const;
 
 		std::string m_ip;
 		int m_s;
@@ -52,10 +76,13 @@ class ChromeCast {
 		double m_player_current_time;
 		time_t m_player_current_time_update;
 		bool m_subtitles = false;
+		unsigned int m_subtitle_track = 1;
 		double m_volume;
 		bool m_muted;
 		std::string m_session_id;
 		unsigned int m_media_session_id;
+		std::map<unsigned int, std::string> m_queue_items;
+		mutable std::mutex m_queue_mutex;
 		unsigned int _request_id();
 		int m_request_id = 0;
 		bool m_init = false;
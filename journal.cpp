@@ -0,0 +1,636 @@
+#include "journal.hpp"
+#include "metrics.hpp"
+#include "patharena.hpp"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <syslog.h>
+
+static const char journal_magic[4] = { 'C', '8', 'P', 'J' };
+static const char snapshot_magic[4] = { 'C', '8', 'P', 'S' };
+// version 2 added the name and duration of inserted tracks
+static const uint32_t version = 2;
+
+// a file mapped read only
+class MappedFile {
+	public:
+		MappedFile(const std::string& path)
+		: m_data(NULL)
+		, m_size(0)
+		{
+			int fd = ::open(path.c_str(), O_RDONLY);
+			if (fd == -1)
+				return;
+			struct stat st;
+			if (fstat(fd, &st) == 0 && st.st_size > 0) {
+				void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (data != MAP_FAILED) {
+					madvise(data, st.st_size, MADV_SEQUENTIAL);
+					m_data = (const char*)data;
+					m_size = st.st_size;
+				}
+			}
+			close(fd);
+		}
+		~MappedFile()
+		{
+			if (m_data)
+				munmap((void*)m_data, m_size);
+		}
+		const char* data() const { return m_data; }
+		size_t size() const { return m_size; }
+	private:
+		const char* m_data;
+		size_t m_size;
+};
+
+struct Reader {
+	const char* p;
+	const char* end;
+
+	bool get(void* data, size_t size)
+	{
+		if ((size_t)(end - p) < size)
+			return false;
+		memcpy(data, p, size);
+		p += size;
+		return true;
+	}
+	bool getId(TrackId& id)
+	{
+		return get(&id.hi, sizeof id.hi) && get(&id.lo, sizeof id.lo);
+	}
+	bool getString(std::string& str)
+	{
+		uint32_t len;
+		if (!get(&len, sizeof len) || (size_t)(end - p) < len)
+			return false;
+		str.assign(p, len);
+		p += len;
+		return true;
+	}
+};
+
+static void put(std::string& out, const void* data, size_t size)
+{
+	out.append((const char*)data, size);
+}
+
+static void put_id(std::string& out, const TrackId& id)
+{
+	put(out, &id.hi, sizeof id.hi);
+	put(out, &id.lo, sizeof id.lo);
+}
+
+static void put_string(std::string& out, const std::string& str)
+{
+	uint32_t len = str.size();
+	put(out, &len, sizeof len);
+	out.append(str);
+}
+
+static bool get_track(Reader& in, uint32_t v, PlaylistItem& item)
+{
+	TrackId uuid;
+	std::string path, name;
+	double duration = -1;
+	if (!in.getId(uuid) || !in.getString(path) || !PathArena::isValid(path))
+		return false;
+	if (v >= 2 && (!in.getString(name) || !in.get(&duration, sizeof duration)))
+		return false;
+	item = PlaylistItem(path, uuid, name, duration);
+	return true;
+}
+
+static void put_track(std::string& out, const PlaylistItem& item)
+{
+	double duration = item.getDuration();
+	put_id(out, item.getId());
+	put_string(out, item.getPath());
+	put_string(out, item.getName());
+	put(out, &duration, sizeof duration);
+}
+
+// FNV-1a, only to tell a torn record at the end of a journal
+static uint32_t checksum(const char* data, size_t size)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+	return hash;
+}
+
+static void encode(std::string& out, const PlaylistOperation& operation)
+{
+	uint8_t type = operation.type;
+	put(out, &type, sizeof type);
+	switch (operation.type) {
+		case PlaylistOperation::Insert:
+			put_track(out, operation.item);
+			break;
+		case PlaylistOperation::Remove:
+		case PlaylistOperation::Queue:
+			put_id(out, operation.uuid);
+			break;
+		case PlaylistOperation::Dequeue:
+			break;
+		case PlaylistOperation::Move:
+			put_id(out, operation.uuid);
+			put_id(out, operation.before);
+			break;
+		case PlaylistOperation::Repeat:
+		case PlaylistOperation::RepeatAll:
+		case PlaylistOperation::Shuffle:
+			{
+				uint8_t value = operation.value;
+				put(out, &value, sizeof value);
+			}
+			break;
+	}
+}
+
+static bool decode(Reader& in, uint32_t v, PlaylistOperation& operation)
+{
+	uint8_t type;
+	TrackId uuid, before;
+	PlaylistItem item;
+	uint8_t value;
+	if (!in.get(&type, sizeof type))
+		return false;
+	switch (type) {
+		case PlaylistOperation::Insert:
+			if (!get_track(in, v, item))
+				return false;
+			operation = PlaylistOperation::insert(item);
+			return true;
+		case PlaylistOperation::Remove:
+			if (!in.getId(uuid))
+				return false;
+			operation = PlaylistOperation::remove(uuid);
+			return true;
+		case PlaylistOperation::Queue:
+			if (!in.getId(uuid))
+				return false;
+			operation = PlaylistOperation::queue(uuid);
+			return true;
+		case PlaylistOperation::Dequeue:
+			operation = PlaylistOperation::dequeue();
+			return true;
+		case PlaylistOperation::Move:
+			if (!in.getId(uuid) || !in.getId(before))
+				return false;
+			operation = PlaylistOperation::move(uuid, before);
+			return true;
+		case PlaylistOperation::Repeat:
+		case PlaylistOperation::RepeatAll:
+		case PlaylistOperation::Shuffle:
+			if (!in.get(&value, sizeof value))
+				return false;
+			if (type == PlaylistOperation::Repeat)
+				operation = PlaylistOperation::repeat(value);
+			else if (type == PlaylistOperation::RepeatAll)
+				operation = PlaylistOperation::repeatAll(value);
+			else
+				operation = PlaylistOperation::shuffle(value);
+			return true;
+	}
+	return false;
+}
+
+static bool write_all(int fd, const std::string& data)
+{
+	size_t written = 0;
+	while (written < data.size())
+	{
+		ssize_t r = write(fd, data.data() + written, data.size() - written);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		written += r;
+	}
+	return true;
+}
+
+PlaylistJournal::PlaylistJournal()
+: m_playlist(NULL)
+, m_fd(-1)
+, m_generation(0)
+, m_journal_size(0)
+, m_snapshot_size(0)
+, m_unsynced(false)
+, m_compacting(false)
+, m_stop(false)
+{
+}
+
+PlaylistJournal::~PlaylistJournal()
+{
+	if (m_playlist)
+		m_playlist->setListener(Playlist::Listener());
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+		m_cond.notify_all();
+	}
+	if (m_syncer.joinable())
+		m_syncer.join();
+	if (m_compactor.joinable())
+		m_compactor.join();
+	if (m_fd != -1) {
+		fsync(m_fd);
+		close(m_fd);
+	}
+}
+
+std::string PlaylistJournal::getJournalFile(uint64_t generation) const
+{
+	char name[32];
+	snprintf(name, sizeof name, "journal.%llu", (unsigned long long)generation);
+	return m_dir + "/" + name;
+}
+
+std::vector<uint64_t> PlaylistJournal::getJournals() const
+{
+	std::vector<uint64_t> journals;
+	DIR* dir = opendir(m_dir.c_str());
+	if (!dir)
+		return journals;
+	while (struct dirent* entry = readdir(dir))
+	{
+		if (strncmp(entry->d_name, "journal.", 8) != 0)
+			continue;
+		char* end;
+		uint64_t generation = strtoull(entry->d_name + 8, &end, 10);
+		if (end != entry->d_name + 8 && *end == '\0')
+			journals.push_back(generation);
+	}
+	closedir(dir);
+	std::sort(journals.begin(), journals.end());
+	return journals;
+}
+
+bool PlaylistJournal::loadSnapshot(uint64_t& generation, std::vector<PlaylistOperation>& operations)
+{
+	MappedFile file(m_dir + "/snapshot");
+	if (!file.data())
+		return false;
+	Reader in = { file.data(), file.data() + file.size() };
+
+	char magic[4];
+	uint32_t v;
+	uint64_t count;
+	uint8_t flags[3];
+	if (!in.get(magic, sizeof magic) || memcmp(magic, snapshot_magic, sizeof magic) != 0 ||
+			!in.get(&v, sizeof v) || v < 1 || v > version ||
+			!in.get(&generation, sizeof generation) || !in.get(flags, sizeof flags) ||
+			!in.get(&count, sizeof count)) {
+		syslog(LOG_ERR, "Invalid playlist snapshot in %s", m_dir.c_str());
+		return false;
+	}
+
+	// tracks, then the play queue, then the flags
+	std::vector<PlaylistOperation> loaded;
+	// a track takes at least 20 bytes, whatever count says
+	loaded.reserve(std::min<uint64_t>(count, file.size() / 20) + 3);
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		PlaylistItem item;
+		if (!get_track(in, v, item)) {
+			syslog(LOG_ERR, "Truncated playlist snapshot in %s", m_dir.c_str());
+			return false;
+		}
+		loaded.push_back(PlaylistOperation::insert(item));
+	}
+	if (!in.get(&count, sizeof count)) {
+		syslog(LOG_ERR, "Truncated playlist snapshot in %s", m_dir.c_str());
+		return false;
+	}
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		TrackId uuid;
+		if (!in.getId(uuid)) {
+			syslog(LOG_ERR, "Truncated playlist snapshot in %s", m_dir.c_str());
+			return false;
+		}
+		loaded.push_back(PlaylistOperation::queue(uuid));
+	}
+	loaded.push_back(PlaylistOperation::repeat(flags[0]));
+	loaded.push_back(PlaylistOperation::repeatAll(flags[1]));
+	loaded.push_back(PlaylistOperation::shuffle(flags[2]));
+
+	operations.swap(loaded);
+	m_snapshot_size = file.size();
+	return true;
+}
+
+// cuts a damaged journal back to what could be read, so it is read the same
+// way on every restart
+static bool truncate_journal(const std::string& path, size_t size)
+{
+	if (!size)
+		return unlink(path.c_str()) == 0;
+	int fd = ::open(path.c_str(), O_WRONLY);
+	if (fd == -1)
+		return false;
+	bool ok = ftruncate(fd, size) == 0 && fsync(fd) == 0;
+	close(fd);
+	return ok;
+}
+
+// a record is a change as it was applied, a torn one (at the end) is
+// dropped as a whole. valid is the size of what could be read.
+bool PlaylistJournal::loadJournal(uint64_t generation, std::vector<PlaylistOperation>& operations, size_t& valid)
+{
+	std::string path = getJournalFile(generation);
+	MappedFile file(path);
+	valid = 0;
+	if (!file.data())
+		return true;
+	Reader in = { file.data(), file.data() + file.size() };
+
+	char magic[4];
+	uint32_t v;
+	if (!in.get(magic, sizeof magic) || memcmp(magic, journal_magic, sizeof magic) != 0 ||
+			!in.get(&v, sizeof v) || v < 1 || v > version) {
+		syslog(LOG_ERR, "Invalid playlist journal %s", path.c_str());
+		return false;
+	}
+
+	while (in.p < in.end)
+	{
+		valid = in.p - file.data();
+		uint32_t size, sum;
+		if (!in.get(&size, sizeof size) || !in.get(&sum, sizeof sum) ||
+				(size_t)(in.end - in.p) < size || checksum(in.p, size) != sum) {
+			syslog(LOG_WARNING, "Dropping a torn record at the end of %s", path.c_str());
+			m_journal_size += valid;
+			return false;
+		}
+		Reader record = { in.p, in.p + size };
+		std::vector<PlaylistOperation> batch;
+		PlaylistOperation operation;
+		while (record.p < record.end)
+		{
+			if (!decode(record, v, operation)) {
+				syslog(LOG_ERR, "Invalid record in %s", path.c_str());
+				m_journal_size += valid;
+				return false;
+			}
+			batch.push_back(operation);
+		}
+		operations.insert(operations.end(), batch.begin(), batch.end());
+		in.p += size;
+	}
+	valid = file.size();
+	m_journal_size += valid;
+	return true;
+}
+
+bool PlaylistJournal::startJournal(uint64_t generation)
+{
+	std::string path = getJournalFile(generation);
+	// never one that is there already, it may be all that is left of a
+	// session
+	int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+	if (fd == -1) {
+		syslog(LOG_ERR, "Could not create %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	std::string header(journal_magic, sizeof journal_magic);
+	put(header, &version, sizeof version);
+	if (!write_all(fd, header)) {
+		syslog(LOG_ERR, "Could not write %s: %s", path.c_str(), strerror(errno));
+		close(fd);
+		unlink(path.c_str());
+		return false;
+	}
+	m_fd = fd;
+	m_generation = generation;
+	m_journal_size = header.size();
+	m_unsynced = true;
+	return true;
+}
+
+// applies the operations in slices, the operations of a slice that fails
+// one at a time, so only those that don't apply are lost. the journal that
+// is started next then holds a playlist without them.
+void PlaylistJournal::replay(Playlist& playlist, const std::vector<PlaylistOperation>& operations)
+{
+	const size_t slice = 4096;
+	size_t skipped = 0;
+	for (size_t begin = 0; begin < operations.size(); begin += slice)
+	{
+		std::vector<PlaylistOperation> part(operations.begin() + begin,
+				operations.begin() + std::min(begin + slice, operations.size()));
+		try {
+			playlist.apply(part);
+			continue;
+		} catch (std::runtime_error&) {
+		}
+		for (auto& operation : part)
+		{
+			try {
+				playlist.apply({ operation });
+			} catch (std::runtime_error&) {
+				skipped++;
+			}
+		}
+	}
+	syslog(LOG_WARNING, "Skipped %zu operations that could not be restored in %s", skipped, m_dir.c_str());
+	metrics_count("journal.errors");
+}
+
+bool PlaylistJournal::open(const std::string& dir, Playlist& playlist)
+{
+	if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+		syslog(LOG_ERR, "Could not create %s: %s", dir.c_str(), strerror(errno));
+		return false;
+	}
+	m_dir = dir;
+
+	auto begin = std::chrono::steady_clock::now();
+	std::vector<PlaylistOperation> operations;
+	uint64_t generation = 0, last = 0;
+	if (!loadSnapshot(generation, operations))
+		generation = 0;
+	bool damaged = false;
+	for (uint64_t journal : getJournals())
+	{
+		std::string path = getJournalFile(journal);
+		if (journal <= generation) {
+			unlink(path.c_str());
+			continue;
+		}
+		// nothing after a damaged journal can be applied on top of it: the
+		// next journal is started before the last one is synced, so it may
+		// refer to tracks that were lost
+		if (damaged) {
+			syslog(LOG_WARNING, "Dropping %s, it comes after a damaged journal", path.c_str());
+			unlink(path.c_str());
+			continue;
+		}
+		last = journal;
+		size_t valid;
+		if (!loadJournal(journal, operations, valid)) {
+			damaged = true;
+			if (!truncate_journal(path, valid)) {
+				syslog(LOG_ERR, "Could not truncate %s: %s", path.c_str(), strerror(errno));
+				metrics_count("journal.errors");
+			}
+		}
+	}
+	try {
+		playlist.apply(operations);
+	} catch (std::runtime_error& e) {
+		syslog(LOG_ERR, "Could not restore the playlist from %s at once: %s", dir.c_str(), e.what());
+		replay(playlist, operations);
+	}
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	syslog(LOG_INFO, "Restored %zu tracks from %s in %.0fms", playlist.getSnapshot()->getTracks().size(),
+			dir.c_str(), elapsed * 1000);
+	metrics_timing("journal.restore", elapsed);
+
+	size_t journaled = m_journal_size;
+	if (!startJournal(std::max(generation, last) + 1))
+		return false;
+	m_journal_size += journaled;
+
+	m_playlist = &playlist;
+	playlist.setListener([this](const std::vector<PlaylistOperation>& operations,
+				const std::shared_ptr<const PlaylistSnapshot>& snapshot) {
+			append(operations, snapshot);
+		});
+	m_syncer = std::thread(&PlaylistJournal::sync, this);
+	return true;
+}
+
+// called with the playlist lock held, so records are in the order the
+// changes were made and the snapshot matches them
+void PlaylistJournal::append(const std::vector<PlaylistOperation>& operations,
+		const std::shared_ptr<const PlaylistSnapshot>& snapshot)
+{
+	if (operations.empty())
+		return;
+	std::string record(8, '\0');
+	for (auto& operation : operations)
+		encode(record, operation);
+	uint32_t size = record.size() - 8, sum = checksum(record.data() + 8, size);
+	memcpy(&record[0], &size, sizeof size);
+	memcpy(&record[4], &sum, sizeof sum);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_fd == -1)
+		return;
+	if (!write_all(m_fd, record)) {
+		syslog(LOG_ERR, "Could not write to %s: %s", getJournalFile(m_generation).c_str(), strerror(errno));
+		metrics_count("journal.errors");
+		return;
+	}
+	m_journal_size += record.size();
+	m_unsynced = true;
+
+	if (m_compacting || m_journal_size < std::max(m_snapshot_size, (size_t)1 << 20))
+		return;
+	int fd = m_fd;
+	uint64_t generation = m_generation;
+	if (!startJournal(generation + 1))
+		return;
+	m_compacting = true;
+	if (m_compactor.joinable())
+		m_compactor.join();
+	m_compactor = std::thread(&PlaylistJournal::compact, this, generation, snapshot, fd);
+}
+
+void PlaylistJournal::sync()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_stop)
+	{
+		m_cond.wait_for(lock, std::chrono::seconds(1), [this]() { return m_stop; });
+		if (!m_unsynced || m_fd == -1)
+			continue;
+		int fd = dup(m_fd);
+		m_unsynced = false;
+		lock.unlock();
+		auto begin = std::chrono::steady_clock::now();
+		fsync(fd);
+		close(fd);
+		metrics_timing("journal.sync", std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+		lock.lock();
+	}
+}
+
+// writes the snapshot that covers the journals up to generation (fd is the
+// last of them), and removes those
+void PlaylistJournal::compact(uint64_t generation, std::shared_ptr<const PlaylistSnapshot> snapshot, int fd)
+{
+	auto begin = std::chrono::steady_clock::now();
+	fsync(fd);
+	close(fd);
+
+	std::string file = m_dir + "/snapshot";
+	std::string tmp = file + ".tmp";
+	size_t size = 0;
+	int out = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	bool ok = out != -1;
+	if (ok) {
+		std::string buf(snapshot_magic, sizeof snapshot_magic);
+		put(buf, &version, sizeof version);
+		put(buf, &generation, sizeof generation);
+		uint8_t flags[3] = { snapshot->getRepeat(), snapshot->getRepeatAll(), snapshot->getShuffle() };
+		put(buf, flags, sizeof flags);
+		uint64_t count = snapshot->getTracks().size();
+		put(buf, &count, sizeof count);
+		for (auto& track : snapshot->getTracks())
+		{
+			put_track(buf, track);
+			if (buf.size() >= 1 << 20) {
+				ok = ok && write_all(out, buf);
+				size += buf.size();
+				buf.clear();
+			}
+		}
+		std::vector<TrackId> queue = snapshot->getQueue();
+		count = queue.size();
+		put(buf, &count, sizeof count);
+		for (auto& uuid : queue)
+			put_id(buf, uuid);
+		ok = ok && write_all(out, buf) && fsync(out) == 0;
+		size += buf.size();
+		close(out);
+	}
+	if (!ok || rename(tmp.c_str(), file.c_str()) != 0) {
+		syslog(LOG_ERR, "Could not write %s: %s", file.c_str(), strerror(errno));
+		metrics_count("journal.errors");
+		unlink(tmp.c_str());
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_compacting = false;
+		return;
+	}
+	int dir = ::open(m_dir.c_str(), O_RDONLY);
+	if (dir != -1) {
+		fsync(dir);
+		close(dir);
+	}
+
+	for (uint64_t journal : getJournals())
+		if (journal <= generation)
+			unlink(getJournalFile(journal).c_str());
+
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	syslog(LOG_DEBUG, "Compacted the playlist journal into %zu bytes in %.1fs", size, elapsed);
+	metrics_timing("journal.compact", elapsed);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_snapshot_size = size;
+	m_compacting = false;
+}
@@ -0,0 +1,54 @@
+#ifndef _JOURNAL_HPP_
+#define _JOURNAL_HPP_
+
+#include "playlist.hpp"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <stdint.h>
+
+// keeps the playlist (the tracks with their uuids, the play queue and the
+// flags) in a directory across restarts. every change is appended to a
+// journal, which is synced to disk once a second. once the journal has
+// grown larger than the last snapshot of the whole playlist, a new journal
+// is started and a snapshot is written in the background. both are
+// numbered, a snapshot covers all journals up to its number.
+class PlaylistJournal {
+	public:
+		PlaylistJournal();
+		~PlaylistJournal();
+
+		// loads what was saved in dir into playlist and records its changes
+		// from then on, false if dir can't be used
+		bool open(const std::string& dir, Playlist& playlist);
+	private:
+		void append(const std::vector<PlaylistOperation>& operations,
+				const std::shared_ptr<const PlaylistSnapshot>& snapshot);
+		void sync();
+		void compact(uint64_t generation, std::shared_ptr<const PlaylistSnapshot> snapshot, int fd);
+		bool loadSnapshot(uint64_t& generation, std::vector<PlaylistOperation>& operations);
+		bool loadJournal(uint64_t generation, std::vector<PlaylistOperation>& operations, size_t& valid);
+		void replay(Playlist& playlist, const std::vector<PlaylistOperation>& operations);
+		std::vector<uint64_t> getJournals() const;
+		std::string getJournalFile(uint64_t generation) const;
+		bool startJournal(uint64_t generation);
+
+		std::string m_dir;
+		Playlist* m_playlist;
+		int m_fd;
+		uint64_t m_generation;
+		size_t m_journal_size;
+		size_t m_snapshot_size;
+		bool m_unsynced;
+		bool m_compacting;
+		bool m_stop;
+		std::thread m_syncer;
+		std::thread m_compactor;
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+};
+
+#endif
@@ -0,0 +1,267 @@
+#include "keyframes.hpp"
+#include "process.hpp"
+#include "metrics.hpp"
+#include "transcoder.hpp"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <functional>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <syslog.h>
+
+extern const char* ffprobepath();
+
+static const char magic[4] = { 'C', '8', 'K', 'F' };
+static const uint32_t version = 1;
+
+KeyframeIndex::KeyframeIndex()
+: m_pid(-1)
+, m_stop(false)
+{
+}
+
+KeyframeIndex::~KeyframeIndex()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+		if (m_pid != -1)
+			process_kill(m_pid);
+		m_cond.notify_all();
+	}
+	if (m_worker.joinable())
+		m_worker.join();
+}
+
+void KeyframeIndex::setDirectory(const std::string& dir)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_dir = dir;
+	if (!m_dir.empty())
+		mkdir(m_dir.c_str(), 0755);
+}
+
+std::string KeyframeIndex::getFile(const std::string& path) const
+{
+	char name[32];
+	snprintf(name, sizeof name, "%016zx.idx", std::hash<std::string>()(path));
+	return m_dir + "/" + name;
+}
+
+std::shared_ptr<const Keyframes> KeyframeIndex::load(const std::string& path, time_t mtime, off_t size) const
+{
+	std::ifstream in(getFile(path), std::ios::binary);
+	char m[4];
+	uint32_t v;
+	int64_t t, s;
+	uint64_t count, len;
+	if (!in.read(m, sizeof m) || memcmp(m, magic, sizeof m) != 0)
+		return std::shared_ptr<const Keyframes>();
+	if (!in.read((char*)&v, sizeof v) || v != version)
+		return std::shared_ptr<const Keyframes>();
+	if (!in.read((char*)&t, sizeof t) || !in.read((char*)&s, sizeof s) || t != mtime || s != size)
+		return std::shared_ptr<const Keyframes>();
+
+	// the path is stored too, in case two of them hash the same
+	if (!in.read((char*)&len, sizeof len) || len > 4096)
+		return std::shared_ptr<const Keyframes>();
+	std::string p(len, '\0');
+	if (!in.read(&p[0], len) || p != path)
+		return std::shared_ptr<const Keyframes>();
+
+	if (!in.read((char*)&count, sizeof count) || count > 100000000)
+		return std::shared_ptr<const Keyframes>();
+	std::shared_ptr<Keyframes> keyframes = std::make_shared<Keyframes>(count);
+	if (count && !in.read((char*)&(*keyframes)[0], count * sizeof(Keyframe)))
+		return std::shared_ptr<const Keyframes>();
+	return keyframes;
+}
+
+void KeyframeIndex::save(const std::string& path, time_t mtime, off_t size, const Keyframes& keyframes) const
+{
+	std::string file = getFile(path);
+	std::string tmp = file + ".tmp";
+	{
+		std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+		int64_t t = mtime, s = size;
+		uint64_t len = path.size(), count = keyframes.size();
+		out.write(magic, sizeof magic);
+		out.write((const char*)&version, sizeof version);
+		out.write((const char*)&t, sizeof t);
+		out.write((const char*)&s, sizeof s);
+		out.write((const char*)&len, sizeof len);
+		out.write(path.data(), len);
+		out.write((const char*)&count, sizeof count);
+		if (count)
+			out.write((const char*)&keyframes[0], count * sizeof(Keyframe));
+		if (!out) {
+			unlink(tmp.c_str());
+			return;
+		}
+	}
+	rename(tmp.c_str(), file.c_str());
+}
+
+std::shared_ptr<const Keyframes> KeyframeIndex::get(const std::string& path)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0)
+		return std::shared_ptr<const Keyframes>();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto ptr = m_index.find(path);
+	if (ptr != m_index.end() && ptr->second.mtime == st.st_mtime && ptr->second.size == st.st_size)
+		return ptr->second.keyframes;
+
+	if (m_dir.empty())
+		return std::shared_ptr<const Keyframes>();
+	std::shared_ptr<const Keyframes> keyframes = load(path, st.st_mtime, st.st_size);
+	if (keyframes) {
+		Entry entry;
+		entry.mtime = st.st_mtime;
+		entry.size = st.st_size;
+		entry.keyframes = keyframes;
+		m_index[path] = entry;
+	}
+	return keyframes;
+}
+
+void KeyframeIndex::build(const std::string& path)
+{
+	if (get(path))
+		return;
+
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_building.count(path))
+		return;
+	m_building.insert(path);
+	Build build;
+	build.path = path;
+	build.mtime = st.st_mtime;
+	build.size = st.st_size;
+	m_queue.push_back(build);
+	if (!m_worker.joinable())
+		m_worker = std::thread(&KeyframeIndex::work, this);
+	m_cond.notify_all();
+}
+
+void KeyframeIndex::work()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true)
+	{
+		m_cond.wait(lock, [this]() {
+				return m_stop || !m_queue.empty();
+			});
+		if (m_stop)
+			return;
+		Build build = m_queue.front();
+		m_queue.pop_front();
+		lock.unlock();
+		run(build.path, build.mtime, build.size);
+		lock.lock();
+	}
+}
+
+void KeyframeIndex::run(const std::string& path, time_t mtime, off_t size)
+{
+	auto begin = std::chrono::steady_clock::now();
+
+	// packets are only demuxed (not decoded), which is fast
+	int fd;
+	pid_t pid = process_spawn({ ffprobepath(), "-v", "error",
+			"-select_streams", "v:0",
+			"-show_entries", "packet=pts_time,pos,flags",
+			"-of", "csv=p=0", path }, NULL, &fd);
+	std::shared_ptr<Keyframes> keyframes = std::make_shared<Keyframes>();
+	int status = -1;
+	if (pid != -1) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_pid = pid;
+			if (m_stop)
+				process_kill(pid);
+		}
+		process_renice(pid, 10);
+
+		// pts_time,pos,flags
+		std::string buf;
+		char data[65536];
+		ssize_t r;
+		while ((r = read(fd, data, sizeof data)) > 0)
+		{
+			buf.append(data, r);
+			std::string::size_type start = 0, eol;
+			while ((eol = buf.find('\n', start)) != std::string::npos)
+			{
+				std::string::size_type flags = buf.rfind(',', eol);
+				if (flags != std::string::npos && flags >= start && buf[flags + 1] == 'K' && buf[start] != 'N') {
+					Keyframe keyframe;
+					char* end;
+					keyframe.time = strtod(buf.c_str() + start, &end);
+					keyframe.pos = *end == ',' && isdigit(end[1]) ? strtoll(end + 1, NULL, 10) : -1;
+					keyframes->push_back(keyframe);
+				}
+				start = eol + 1;
+			}
+			buf.erase(0, start);
+		}
+		close(fd);
+		status = process_wait(pid);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_pid = -1;
+	}
+	std::sort(keyframes->begin(), keyframes->end(), [](const Keyframe& a, const Keyframe& b) {
+			return a.time < b.time;
+		});
+
+	// -ss is relative to the start of the file, packet timestamps are not
+	double start = probe_start(probe(path));
+	for (auto& keyframe : *keyframes)
+		keyframe.time -= start;
+
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	syslog(LOG_DEBUG, "Indexed %zu keyframes of %s in %.1fs", keyframes->size(), path.c_str(), elapsed);
+	metrics_timing("keyframes.index", elapsed);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_building.erase(path);
+	// an empty index is only kept if ffprobe got through the file, it has
+	// no video then (or none that is indexed), which wouldn't change
+	if (m_stop || (keyframes->empty() && status != 0))
+		return;
+	Entry entry;
+	entry.mtime = mtime;
+	entry.size = size;
+	entry.keyframes = keyframes;
+	m_index[path] = entry;
+	if (!m_dir.empty())
+		save(path, mtime, size, *keyframes);
+}
+
+double KeyframeIndex::snap(const std::string& path, double time)
+{
+	if (time <= 0)
+		return time;
+	std::shared_ptr<const Keyframes> keyframes = get(path);
+	if (!keyframes || keyframes->empty())
+		return time;
+	auto ptr = std::upper_bound(keyframes->begin(), keyframes->end(), time,
+			[](double t, const Keyframe& keyframe) {
+				return t < keyframe.time;
+			});
+	if (ptr == keyframes->begin())
+		return time;
+	metrics_count("keyframes.snapped");
+	return (ptr - 1)->time;
+}
@@ -0,0 +1,68 @@
+#ifndef _KEYFRAMES_HPP_
+#define _KEYFRAMES_HPP_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+struct Keyframe {
+	double time;
+	int64_t pos;
+};
+typedef std::vector<Keyframe> Keyframes;
+
+// the keyframes (time and byte offset) of the first video stream of each
+// file, indexed by ffprobe in the background and persisted in a directory
+// (so a file is only ever indexed once, until it is modified). a file
+// without video has an empty index, which is kept just the same.
+class KeyframeIndex {
+	public:
+		KeyframeIndex();
+		~KeyframeIndex();
+
+		void setDirectory(const std::string& dir);
+		void build(const std::string& path);
+		std::shared_ptr<const Keyframes> get(const std::string& path);
+
+		// the last keyframe at or before time, or time itself if the file
+		// isn't indexed (yet)
+		double snap(const std::string& path, double time);
+	private:
+		void work();
+		void run(const std::string& path, time_t mtime, off_t size);
+		std::string getFile(const std::string& path) const;
+		std::shared_ptr<const Keyframes> load(const std::string& path, time_t mtime, off_t size) const;
+		void save(const std::string& path, time_t mtime, off_t size, const Keyframes& keyframes) const;
+
+		struct Entry {
+			time_t mtime;
+			off_t size;
+			std::shared_ptr<const Keyframes> keyframes;
+		};
+		struct Build {
+			std::string path;
+			time_t mtime;
+			off_t size;
+		};
+		std::string m_dir;
+		std::map<std::string, Entry> m_index;
+		std::set<std::string> m_building;
+		// the files are indexed one at a time by m_worker, which is joined
+		// (after killing the ffprobe in m_pid) on destruction
+		std::deque<Build> m_queue;
+		std::thread m_worker;
+		pid_t m_pid;
+		bool m_stop;
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+};
+
+#endif
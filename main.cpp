@@ -1,11 +1,15 @@
 #include "playlist.hpp"
 #include "chromecast.hpp"
 #include "webserver.hpp"
+#include "journal.hpp"
+#include "playlistfile.hpp"
+#include "patharena.hpp"
+#include "process.hpp"
 #include "cast_channel.pb.h"
 #include <syslog.h>
 #include <getopt.h>
-#include <fstream>
 #include <atomic>
+#include <algorithm>
 
 void usage();
 extern char* __progname;
@@ -17,15 +21,33 @@ const char* ffmpegpath()
 	return "ffmpeg";
 }
 
+const char* ffprobepath()
+{
+	if (access("./ffprobe", F_OK) == 0)
+		return "./ffprobe";
+	return "ffprobe";
+}
+
 int main(int argc, char* argv[])
 {
 	GOOGLE_PROTOBUF_VERIFY_VERSION;
 	signal(SIGPIPE, SIG_IGN);
+	process_init();
 	openlog(NULL, LOG_PID | LOG_PERROR, LOG_DAEMON);
 
 	std::string ip;
 	unsigned short port = 8080;
 	bool subtitles = false, play = false, exitOnFinish = false;
+	std::string hls;
+	size_t hlsMemory = 512;
+	unsigned int workers = 1, chunkSize = 30, maxStreams = 2;
+	unsigned int readAhead = 16, readAheadSeconds = 0;
+	bool zeroCopy = false;
+	unsigned int prefetchSeconds = 0, gapless = 0;
+	std::string indexDir = "/tmp/c8tsender-index";
+	unsigned int stallTimeout = 30;
+	std::string stateDir;
+	std::string engine = "process";
 	std::atomic<bool> done(false);
 	Playlist playlist;
 
@@ -37,15 +59,32 @@ int main(int argc, char* argv[])
 		{ "play", no_argument, NULL, 'y' },
 		{ "subtitles", no_argument, NULL, 'S' },
 		{ "shuffle", no_argument, NULL, 's' },
+		{ "shuffle-history", required_argument, NULL, 'W' },
 		{ "repeat", no_argument, NULL, 'r' },
 		{ "repeat-all", no_argument, NULL, 'R' },
 		{ "track", required_argument, NULL, 't' },
 		{ "exit-on-finish", no_argument, NULL, 'x' },
+		{ "hls", required_argument, NULL, 'H' },
+		{ "hls-memory", required_argument, NULL, 'M' },
+		{ "workers", required_argument, NULL, 'w' },
+		{ "chunk-size", required_argument, NULL, 'C' },
+		{ "engine", required_argument, NULL, 'e' },
+		{ "max-streams", required_argument, NULL, 'm' },
+		{ "read-ahead", required_argument, NULL, 'a' },
+		{ "read-ahead-seconds", required_argument, NULL, 'A' },
+		{ "zero-copy", no_argument, NULL, 'z' },
+		{ "prefetch", required_argument, NULL, 'f' },
+		{ "gapless", required_argument, NULL, 'g' },
+		{ "index-dir", required_argument, NULL, 'i' },
+		{ "stall-timeout", required_argument, NULL, 'T' },
+		{ "state-dir", required_argument, NULL, 'd' },
 		{ NULL, 0, NULL, 0 }
 	};
 
+	// the playlist options are applied together, once they are all read
+	std::vector<PlaylistOperation> operations;
 	int ch;
-	while ((ch = getopt_long(argc, argv, "hc:p:P:sSrRyt:x", longopts, NULL)) != -1) {
+	while ((ch = getopt_long(argc, argv, "hc:p:P:sSrRyt:xH:M:w:C:e:m:a:A:zf:g:i:T:W:d:", longopts, NULL)) != -1) {
 		switch (ch) {
 			case 'c':
 				ip = optarg;
@@ -54,33 +93,90 @@ int main(int argc, char* argv[])
 				port = strtoul(optarg, NULL, 10);
 				break;
 			case 'P':
-				{
-					std::ifstream input(optarg);
-					for (std::string line; getline(input, line);)
-						playlist.insert(line);
+				try {
+					for (auto& item : playlist_read(optarg))
+						operations.push_back(PlaylistOperation::insert(item));
+				} catch (const std::runtime_error& e) {
+					syslog(LOG_ERR, "--playlist failed: %s", e.what());
 				}
 				break;
 			case 's':
-				playlist.setShuffle(true);
+				operations.push_back(PlaylistOperation::shuffle(true));
+				break;
+			case 'W':
+				playlist.setShuffleHistory(strtoul(optarg, NULL, 10));
 				break;
 			case 'S':
 				subtitles = true;
 				break;
 			case 'r':
-				playlist.setRepeat(true);
+				operations.push_back(PlaylistOperation::repeat(true));
 				break;
 			case 'R':
-				playlist.setRepeatAll(true);
+				operations.push_back(PlaylistOperation::repeatAll(true));
 				break;
 			case 'y':
 				play = true;
 				break;
 			case 't':
-				playlist.insert(std::string(optarg));
+				if (PathArena::isValid(optarg))
+					operations.push_back(PlaylistOperation::insert(std::string(optarg)));
+				else
+					syslog(LOG_ERR, "--track %s is too long", optarg);
 				break;
 			case 'x':
 				exitOnFinish = true;
 				break;
+			case 'H':
+				if (!Webserver::isHlsSegmentType(optarg)) {
+					syslog(LOG_ERR, "unknown hls segment type: %s", optarg);
+					usage();
+				}
+				hls = optarg;
+				break;
+			case 'M':
+				hlsMemory = strtoul(optarg, NULL, 10);
+				break;
+			case 'w':
+				workers = strtoul(optarg, NULL, 10);
+				break;
+			case 'C':
+				chunkSize = strtoul(optarg, NULL, 10);
+				break;
+			case 'e':
+				if (!Webserver::isEngine(optarg)) {
+					syslog(LOG_ERR, "unsupported engine: %s", optarg);
+					usage();
+				}
+				engine = optarg;
+				break;
+			case 'm':
+				maxStreams = strtoul(optarg, NULL, 10);
+				break;
+			case 'a':
+				readAhead = strtoul(optarg, NULL, 10);
+				break;
+			case 'A':
+				readAheadSeconds = strtoul(optarg, NULL, 10);
+				break;
+			case 'z':
+				zeroCopy = true;
+				break;
+			case 'f':
+				prefetchSeconds = strtoul(optarg, NULL, 10);
+				break;
+			case 'g':
+				gapless = strtoul(optarg, NULL, 10);
+				break;
+			case 'i':
+				indexDir = optarg;
+				break;
+			case 'T':
+				stallTimeout = strtoul(optarg, NULL, 10);
+				break;
+			case 'd':
+				stateDir = optarg;
+				break;
 			default:
 			case 'h':
 				usage();
@@ -90,40 +186,50 @@ int main(int argc, char* argv[])
 	if (ip.empty())
 		usage();
 
+	// a saved playlist is used as it is, the tracks given on the command
+	// line would only be added again on every restart
+	PlaylistJournal journal;
+	if (!stateDir.empty() && journal.open(stateDir, playlist) &&
+			!playlist.getSnapshot()->getTracks().empty()) {
+		operations.erase(std::remove_if(operations.begin(), operations.end(), [](const PlaylistOperation& operation) {
+				return operation.type == PlaylistOperation::Insert;
+			}), operations.end());
+	}
+	playlist.apply(operations);
+
 	ChromeCast chromecast(ip);
 	chromecast.init();
 	chromecast.setSubtitleSettings(subtitles);
-	chromecast.setMediaStatusCallback([&chromecast, &playlist, port, exitOnFinish, &done](const std::string& playerState,
+	Webserver http(port, chromecast, playlist);
+	http.setHlsSegmentType(hls);
+	http.setHlsMemoryLimit(hlsMemory * 1024 * 1024);
+	http.setTranscodeWorkers(workers);
+	http.setChunkSize(chunkSize);
+	http.setEngine(engine);
+	http.setMaxStreams(maxStreams);
+	http.setReadAhead((size_t)readAhead * 1024 * 1024, readAheadSeconds);
+	http.setZeroCopy(zeroCopy);
+	http.setPrefetch(prefetchSeconds);
+	http.setGapless(gapless);
+	http.setIndexDirectory(indexDir);
+	http.setStallTimeout(stallTimeout);
+	chromecast.setMediaStatusCallback([&http, &playlist, exitOnFinish, &done](const std::string& playerState,
 			const std::string& idleReason, const std::string& uuid) -> void {
 		syslog(LOG_DEBUG, "mediastatus: %s %s %s", playerState.c_str(), idleReason.c_str(), uuid.c_str());
-		if (playerState == "IDLE") {
-			if (idleReason == "FINISHED") {
-				try {
-					std::lock_guard<std::mutex> lock(playlist.getMutex());
-					if (exitOnFinish && (playlist.getTracks().rbegin())->getUUID() == uuid) {
-						syslog(LOG_DEBUG, "playlist done");
-						done = true;
-						return;
-					}
-					PlaylistItem track = playlist.getNextTrack(uuid);
-					std::thread foo([&chromecast, port, track]() {
-						chromecast.load("http://" + chromecast.getSocketName() + ":" + std::to_string(port) + "/stream/" + track.getUUID(),
-							track.getName(), track.getUUID());
-					});
-					foo.detach();
-				} catch (...) {
-					// ...
-				}
+		if (playerState == "IDLE" && idleReason == "FINISHED" && exitOnFinish) {
+			std::shared_ptr<const PlaylistSnapshot> snapshot = playlist.getSnapshot();
+			if (!snapshot->getTracks().empty() && snapshot->getTracks().back().getId().str() == uuid) {
+				syslog(LOG_DEBUG, "playlist done");
+				done = true;
+				return;
 			}
 		}
+		http.mediaStatus(playerState, idleReason, uuid);
 	});
-	Webserver http(port, chromecast, playlist);
 	if (play) {
 		try {
-			const PlaylistItem& track = playlist.getNextTrack();
-			chromecast.load(
-				"http://" + chromecast.getSocketName() + ":" + std::to_string(port) + "/stream/" + track.getUUID(),
-				track.getName(), track.getUUID());
+			PlaylistItem track = playlist.getNextTrack();
+			http.load(track.getId().str(), track.getName());
 		} catch (const std::runtime_error& e) {
 			syslog(LOG_DEBUG, "--play failed: %s", e.what());
 		}
@@ -136,6 +242,14 @@ void usage()
 {
 	printf("%s --chromecast <ip> [ --port <number> ] [ --playlist <path> ]\n"
 			"\t[ --shuffle ] [ --repeat ] [ --repeat-all ]\n"
-			"\t[ --subtitles ] [ --play ] [ --track <file> ]\n", __progname);
+			"\t[ --shuffle-history <tracks> ]\n"
+			"\t[ --subtitles ] [ --play ] [ --track <file> ]\n"
+			"\t[ --hls <ts|fmp4> ] [ --hls-memory <MB> ]\n"
+			"\t[ --workers <number> ] [ --chunk-size <seconds> ]\n"
+			"\t[ --engine <process|libav> ] [ --max-streams <number> ]\n"
+			"\t[ --read-ahead <MB> ] [ --read-ahead-seconds <seconds> ]\n"
+			"\t[ --zero-copy ] [ --prefetch <seconds> ]\n"
+			"\t[ --gapless <preload seconds> ] [ --index-dir <path> ]\n"
+			"\t[ --stall-timeout <seconds> ] [ --state-dir <path> ]\n", __progname);
 	exit(1);
 }
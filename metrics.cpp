@@ -0,0 +1,76 @@
+#include "metrics.hpp"
+#include <mutex>
+#include <map>
+
+struct Metric
+{
+	std::string type;
+	double value;
+	unsigned long long count;
+	double min;
+	double max;
+};
+
+static std::mutex g_mutex;
+static std::map<std::string, Metric> g_metrics;
+
+static Metric& metric(const std::string& name, const std::string& type)
+{
+	auto ptr = g_metrics.find(name);
+	if (ptr == g_metrics.end()) {
+		Metric m;
+		m.type = type;
+		m.value = 0;
+		m.count = 0;
+		m.min = 0;
+		m.max = 0;
+		ptr = g_metrics.insert(std::make_pair(name, m)).first;
+	}
+	return ptr->second;
+}
+
+void metrics_count(const std::string& name, double value)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	metric(name, "counter").value += value;
+}
+
+void metrics_gauge(const std::string& name, double value)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	metric(name, "gauge").value = value;
+}
+
+void metrics_timing(const std::string& name, double seconds)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	Metric& m = metric(name, "timing");
+	if (m.count == 0 || seconds < m.min)
+		m.min = seconds;
+	if (m.count == 0 || seconds > m.max)
+		m.max = seconds;
+	m.value += seconds;
+	m.count++;
+}
+
+Json::Value metrics_json()
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+
+	Json::Value json(Json::objectValue);
+	for (auto& item : g_metrics)
+	{
+		const Metric& m = item.second;
+		if (m.type == "timing") {
+			Json::Value t;
+			t["count"] = (Json::UInt64)m.count;
+			t["total"] = m.value;
+			t["avg"] = m.count ? m.value / m.count : 0;
+			t["min"] = m.min;
+			t["max"] = m.max;
+			json[item.first] = t;
+		} else
+			json[item.first] = m.value;
+	}
+	return json;
+}
@@ -0,0 +1,13 @@
+#ifndef _METRICS_HPP_
+#define _METRICS_HPP_
+
+#include <json/json.h>
+#include <string>
+
+// process wide metrics, exposed as json on /metrics
+void metrics_count(const std::string& name, double value = 1);
+void metrics_gauge(const std::string& name, double value);
+void metrics_timing(const std::string& name, double seconds);
+Json::Value metrics_json();
+
+#endif
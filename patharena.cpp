@@ -0,0 +1,189 @@
+#include "patharena.hpp"
+#include "metrics.hpp"
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <limits.h>
+#include <syslog.h>
+
+// a string is stored as [uint16 size][chars], a directory node as
+// [uint32 parent][uint16 size][name], neither ever spans two chunks. the
+// offset of a record is its chunk in the upper bits and its position in it.
+PathArena::PathArena()
+: m_chunk_count(0)
+, m_used(ChunkSize)
+, m_last_directory(0)
+{
+}
+
+// PATH_MAX is well below MaxLength, so it bounds every component too
+bool PathArena::isValid(const char* path, size_t size)
+{
+	if (size > PATH_MAX)
+		return false;
+	const char* end = path + size;
+	size_t depth = 0;
+	while (path < end)
+	{
+		const char* slash = (const char*)memchr(path, '/', end - path);
+		if (!slash)
+			slash = end;
+		if (++depth > MaxDepth)
+			return false;
+		path = slash + 1;
+	}
+	return true;
+}
+
+bool PathArena::isValid(const std::string& path)
+{
+	return isValid(path.data(), path.size());
+}
+
+const char* PathArena::at(uint32_t offset) const
+{
+	return m_chunks[offset >> ChunkBits] + (offset & (ChunkSize - 1));
+}
+
+uint32_t PathArena::add(const char* data, size_t size, uint32_t parent, bool node)
+{
+	if (size > MaxLength)
+		throw std::runtime_error("path too long");
+	size_t record = (node ? sizeof parent : 0) + sizeof(uint16_t) + size;
+	if (m_used + record > ChunkSize) {
+		if (m_chunk_count == MaxChunks)
+			throw std::runtime_error("path arena is full");
+		m_chunks[m_chunk_count] = new char[ChunkSize];
+		// offset 0 is never handed out, it stands for none
+		m_used = m_chunk_count ? 0 : 1;
+		m_chunk_count++;
+		metrics_gauge("playlist.arena_bytes", (double)m_chunk_count * ChunkSize);
+		if (m_chunk_count == MaxChunks / 4 * 3)
+			syslog(LOG_WARNING, "The playlist path arena is 3/4 full, restart to reclaim the paths of removed tracks");
+	}
+	uint32_t offset = (uint32_t)(m_chunk_count - 1) << ChunkBits | m_used;
+	char* p = m_chunks[m_chunk_count - 1] + m_used;
+	if (node) {
+		memcpy(p, &parent, sizeof parent);
+		p += sizeof parent;
+	}
+	uint16_t length = size;
+	memcpy(p, &length, sizeof length);
+	memcpy(p + sizeof length, data, size);
+	m_used += record;
+	return offset;
+}
+
+// the parents are added first, the name of the root of an absolute path is
+// empty (as is any between two slashes, so URLs come back as they were)
+uint32_t PathArena::addDirectory(const char* path, size_t size)
+{
+	std::string key(path, size);
+	auto ptr = m_directories.find(key);
+	if (ptr != m_directories.end())
+		return ptr->second;
+	uint32_t parent = 0;
+	size_t begin = 0;
+	while (true)
+	{
+		const char* slash = (const char*)memchr(path + begin, '/', size - begin);
+		size_t end = slash ? slash - path : size;
+		key.assign(path, end);
+		ptr = m_directories.find(key);
+		if (ptr != m_directories.end())
+			parent = ptr->second;
+		else {
+			parent = add(path + begin, end - begin, parent, true);
+			m_directories.emplace(key, parent);
+		}
+		if (end == size)
+			return parent;
+		begin = end + 1;
+	}
+}
+
+void PathArena::addPath(const std::string& path, uint32_t& directory, uint32_t& file)
+{
+	std::string::size_type slash = path.find_last_of('/');
+	size_t begin = slash == std::string::npos ? 0 : slash + 1;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (slash == std::string::npos)
+		directory = 0;
+	else if (m_last_directory && m_last_path.size() == slash && path.compare(0, slash, m_last_path) == 0)
+		directory = m_last_directory;
+	else {
+		directory = addDirectory(path.data(), slash);
+		m_last_path.assign(path, 0, slash);
+		m_last_directory = directory;
+	}
+	file = begin < path.size() ? add(path.data() + begin, path.size() - begin, 0, false) : 0;
+}
+
+uint32_t PathArena::addString(const std::string& str)
+{
+	if (str.empty())
+		return 0;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return add(str.data(), std::min(str.size(), (size_t)MaxLength), 0, false);
+}
+
+// records are never changed once added, and the chunk of an offset was
+// stored before the offset was handed out, so reading needs no lock
+void PathArena::appendDirectory(std::string& out, uint32_t directory) const
+{
+	// the nodes from directory up to the root
+	std::vector<const char*> nodes;
+	while (directory) {
+		const char* node = at(directory);
+		nodes.push_back(node);
+		memcpy(&directory, node, sizeof directory);
+	}
+	for (auto i = nodes.rbegin(); i != nodes.rend(); ++i) {
+		uint16_t size;
+		memcpy(&size, *i + sizeof directory, sizeof size);
+		if (i != nodes.rbegin())
+			out += '/';
+		out.append(*i + sizeof directory + sizeof size, size);
+	}
+}
+
+std::string PathArena::getPath(uint32_t directory, uint32_t file) const
+{
+	std::string path;
+	if (directory) {
+		appendDirectory(path, directory);
+		path += '/';
+	}
+	size_t size;
+	const char* name = getString(file, size);
+	path.append(name, size);
+	return path;
+}
+
+const char* PathArena::getString(uint32_t offset, size_t& size) const
+{
+	if (!offset) {
+		size = 0;
+		return "";
+	}
+	const char* p = at(offset);
+	uint16_t length;
+	memcpy(&length, p, sizeof length);
+	size = length;
+	return p + sizeof length;
+}
+
+std::string PathArena::getString(uint32_t offset) const
+{
+	size_t size;
+	const char* str = getString(offset, size);
+	return std::string(str, size);
+}
+
+// never destroyed, items may outlive anything else
+PathArena& path_arena()
+{
+	static PathArena* arena = new PathArena();
+	return *arena;
+}
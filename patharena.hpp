@@ -0,0 +1,59 @@
+#ifndef _PATHARENA_HPP_
+#define _PATHARENA_HPP_
+
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <stdint.h>
+
+// the strings of the playlist items, appended to chunks that are never moved
+// or freed, so an item only keeps 32 bit offsets into them (0 is none) and
+// can be copied freely. directories are interned as nodes of their name and
+// the offset of their parent, the tracks of an album share theirs.
+//
+// nothing is reclaimed: the file names (and titles) of removed tracks stay,
+// as do those of tracks added again, so the arena grows by every track that
+// was ever added. it holds 4GB, a warning is logged at 3GB. the journal only
+// keeps the tracks that are in the playlist, restarting with --state-dir
+// starts over with just those.
+class PathArena {
+	public:
+		PathArena();
+
+		// if path fits in the arena: at most PATH_MAX long, with at most
+		// MaxDepth components
+		static bool isValid(const char* path, size_t size);
+		static bool isValid(const std::string& path);
+
+		// the directory (0 if there is none) and the file name of path, both
+		// are added to the arena. throws std::runtime_error once it is full.
+		void addPath(const std::string& path, uint32_t& directory, uint32_t& file);
+		// cut to the longest that fits
+		uint32_t addString(const std::string& str);
+
+		std::string getPath(uint32_t directory, uint32_t file) const;
+		std::string getString(uint32_t offset) const;
+		// the string at offset, as it is in the arena
+		const char* getString(uint32_t offset, size_t& size) const;
+	private:
+		uint32_t addDirectory(const char* path, size_t size);
+		uint32_t add(const char* data, size_t size, uint32_t parent, bool node);
+		void appendDirectory(std::string& out, uint32_t directory) const;
+		const char* at(uint32_t offset) const;
+
+		enum { ChunkBits = 20, ChunkSize = 1 << ChunkBits, MaxChunks = 1 << (32 - ChunkBits),
+			MaxLength = 0xffff, MaxDepth = 256 };
+		char* m_chunks[MaxChunks];
+		size_t m_chunk_count;
+		size_t m_used;
+		std::unordered_map<std::string, uint32_t> m_directories;
+		// the directory added last, tracks usually come an album at a time
+		std::string m_last_path;
+		uint32_t m_last_directory;
+		std::mutex m_mutex;
+};
+
+// the one all playlist items use
+PathArena& path_arena();
+
+#endif
@@ -1,195 +1,921 @@
 #include "playlist.hpp"
-#include <libgen.h>
-#include <uuid/uuid.h>
+#include "metrics.hpp"
+#include "patharena.hpp"
+#include <algorithm>
 #include <random>
+#include <iterator>
+#include <unordered_set>
 
-std::string uuidgen()
+PlaylistItem::PlaylistItem()
+: m_directory(0)
+, m_file(0)
+, m_title(0)
+, m_duration(-1)
 {
-	uuid_t out;
-	uuid_generate(out);
-	uuid_string_t str;
-	uuid_unparse(out, str);
-	return str;
 }
 
 PlaylistItem::PlaylistItem(const std::string& path)
+: PlaylistItem(path, TrackId::generate())
 {
-	m_path = path;
-	m_name = basename((char*)path.c_str());
-	if (m_name.find_last_of(".") != std::string::npos)
-		m_name.erase(m_name.find_last_of("."), std::string::npos);
-	m_uuid = uuidgen();
 }
 
-const std::string& PlaylistItem::getName() const
+// a name that can be had from the path (as one read back from the journal
+// usually is) isn't stored again
+PlaylistItem::PlaylistItem(const std::string& path, const TrackId& id, const std::string& name, double duration)
+: m_id(id)
+, m_title(0)
+, m_duration(duration)
 {
-	return m_name;
+	path_arena().addPath(path, m_directory, m_file);
+	if (!name.empty() && name != getName())
+		m_title = path_arena().addString(name);
 }
 
-const std::string& PlaylistItem::getPath() const
+// the file name without its extension, sliced out of the arena
+std::string PlaylistItem::getName() const
 {
-	return m_path;
+	if (m_title)
+		return path_arena().getString(m_title);
+	size_t size;
+	const char* file = path_arena().getString(m_file, size);
+	size_t end = size;
+	while (end && file[end - 1] != '.')
+		--end;
+	return std::string(file, end ? end - 1 : size);
 }
 
-const std::string& PlaylistItem::getUUID() const
+std::string PlaylistItem::getPath() const
 {
-	return m_uuid;
+	return path_arena().getPath(m_directory, m_file);
 }
 
-Playlist::Playlist()
-: m_repeat(false)
-, m_repeatall(false)
-, m_shuffle(false)
+const TrackId& PlaylistItem::getId() const
 {
-	m_uuid = uuidgen();
+	return m_id;
 }
 
-void Playlist::insert(const PlaylistItem& item)
+double PlaylistItem::getDuration() const
 {
-	m_items.push_back(item);
-	m_uuid = uuidgen();
+	return m_duration;
 }
 
-bool Playlist::remove(const std::string& uuid)
+TrackList::TrackList()
+: m_index(Entry { TrackId(), 0 }, IdOf())
+, m_size(0)
 {
-	auto ptr = std::remove_if(m_items.begin(), m_items.end(),
-			[&uuid](PlaylistItem const& item) {
-				return item.getUUID() == uuid;
-			});
-	if (ptr == m_items.end())
+}
+
+// there are no empty chunks
+bool TrackList::locate(const TrackId& uuid, size_t& chunk, size_t& offset) const
+{
+	const Entry* entry = m_index.find(uuid);
+	if (!entry)
 		return false;
+	chunk = m_positions[entry->chunk];
+	const std::vector<PlaylistItem>& items = m_chunks[chunk]->items;
+	for (offset = 0; items[offset].getId() != uuid; ++offset)
+		;
+	return true;
+}
 
-	auto ptr2 = std::remove_if(m_queue.begin(), m_queue.end(),
-			[&uuid](std::string const& item) {
-				return item == uuid;
-			});
-	if (ptr2 != m_queue.end())
-		m_queue.erase(ptr2, m_queue.end());
+const PlaylistItem* TrackList::find(const TrackId& uuid) const
+{
+	size_t chunk, offset;
+	if (!locate(uuid, chunk, offset))
+		return NULL;
+	return &m_chunks[chunk]->items[offset];
+}
 
-	m_items.erase(ptr, m_items.end());
-	m_uuid = uuidgen();
-	return true;
+const PlaylistItem* TrackList::next(const TrackId& uuid) const
+{
+	size_t chunk, offset;
+	if (!locate(uuid, chunk, offset))
+		return NULL;
+	if (offset + 1 < m_chunks[chunk]->items.size())
+		return &m_chunks[chunk]->items[offset + 1];
+	if (chunk + 1 < m_chunks.size())
+		return &m_chunks[chunk + 1]->items.front();
+	return NULL;
 }
 
-void Playlist::queueTrack(const std::string& uuid)
+const PlaylistItem& TrackList::front() const
 {
-	m_queue.push_back(uuid);
-	m_uuid = uuidgen();
+	return m_chunks.front()->items.front();
 }
 
-const PlaylistItem& Playlist::getTrack(const std::string& uuid) const
+const PlaylistItem& TrackList::back() const
 {
-	auto ptr = std::find_if(m_items.begin(), m_items.end(),
-			[&uuid](PlaylistItem const& item) {
-				return item.getUUID() == uuid;
-			});
-	if (ptr == m_items.end())
-		throw std::runtime_error("track not found");
-	return *ptr;
+	return m_chunks.back()->items.back();
 }
 
-const PlaylistItem& Playlist::getNextTrack(const std::string& uuid) const
+TrackList::Iterator TrackList::begin() const
 {
-	if (m_items.empty())
-		throw std::runtime_error("playlist is empty");
+	return Iterator(this, 0, 0);
+}
+
+TrackList::Iterator TrackList::end() const
+{
+	return Iterator(this, m_chunks.size(), 0);
+}
+
+size_t TrackList::size() const
+{
+	return m_size;
+}
+
+bool TrackList::empty() const
+{
+	return m_size == 0;
+}
+
+// appending starts a new chunk once the last is full, so it never splits one
+void TrackList::push_back(const PlaylistItem& item)
+{
+	if (m_chunks.empty() || m_chunks.back()->items.size() >= ChunkSize)
+		addChunk(m_chunks.size());
+	insert(m_chunks.size() - 1, m_chunks.back()->items.size(), item);
+}
+
+void TrackList::insert(size_t chunk, size_t offset, const PlaylistItem& item)
+{
+	Chunk& writable = unshare(m_chunks[chunk]);
+	writable.items.insert(writable.items.begin() + offset, item);
+	m_index.insert(Entry { item.getId(), writable.key });
+	m_size++;
+	if (writable.items.size() > 2 * ChunkSize)
+		split(chunk);
+}
+
+void TrackList::erase(const TrackId& uuid)
+{
+	size_t chunk, offset;
+	if (!locate(uuid, chunk, offset))
+		return;
+	Chunk& writable = unshare(m_chunks[chunk]);
+	writable.items.erase(writable.items.begin() + offset);
+	m_index.erase(uuid);
+	m_size--;
+	if (writable.items.empty())
+		removeChunk(chunk);
+	else
+		merge(chunk);
+}
+
+void TrackList::move(const TrackId& uuid, const TrackId& before)
+{
+	size_t chunk, offset;
+	if (uuid == before || !locate(uuid, chunk, offset))
+		return;
+	PlaylistItem item = m_chunks[chunk]->items[offset];
+	erase(uuid);
+	if (!before.empty() && locate(before, chunk, offset))
+		insert(chunk, offset, item);
+	else
+		push_back(item);
+}
+
+void TrackList::reserve(size_t tracks)
+{
+	m_index.reserve(m_size + tracks);
+	m_chunks.reserve(m_chunks.size() + tracks / ChunkSize + 1);
+}
+
+// keys of removed chunks are used again, so m_positions stays as long as
+// the most chunks there ever were
+void TrackList::addChunk(size_t position)
+{
+	std::shared_ptr<Chunk> chunk = std::make_shared<Chunk>();
+	if (m_free_keys.empty()) {
+		chunk->key = m_positions.size();
+		m_positions.push_back(0);
+	} else {
+		chunk->key = m_free_keys.back();
+		m_free_keys.pop_back();
+	}
+	chunk->items.reserve(ChunkSize);
+	m_chunks.insert(m_chunks.begin() + position, chunk);
+	reposition(position);
+}
+
+void TrackList::removeChunk(size_t position)
+{
+	m_free_keys.push_back(m_chunks[position]->key);
+	m_chunks.erase(m_chunks.begin() + position);
+	reposition(position);
+}
+
+void TrackList::reposition(size_t from)
+{
+	for (size_t i = from; i < m_chunks.size(); ++i)
+		m_positions[m_chunks[i]->key] = i;
+}
+
+// the tracks that change chunks are updated in the index
+void TrackList::split(size_t chunk)
+{
+	addChunk(chunk + 1);
+	Chunk& from = unshare(m_chunks[chunk]);
+	Chunk& to = *m_chunks[chunk + 1];
+	size_t half = from.items.size() / 2;
+	to.items.assign(from.items.begin() + half, from.items.end());
+	from.items.resize(half);
+	for (auto& item : to.items)
+		m_index.modify(item.getId())->chunk = to.key;
+}
+
+void TrackList::merge(size_t chunk)
+{
+	size_t size = m_chunks[chunk]->items.size();
+	if (size >= ChunkSize / 4)
+		return;
+	size_t into;
+	if (chunk + 1 < m_chunks.size() && m_chunks[chunk + 1]->items.size() + size <= ChunkSize)
+		into = chunk + 1;
+	else if (chunk > 0 && m_chunks[chunk - 1]->items.size() + size <= ChunkSize)
+		into = chunk - 1;
+	else
+		return;
+	const Chunk& from = *m_chunks[chunk];
+	Chunk& to = unshare(m_chunks[into]);
+	to.items.insert(into > chunk ? to.items.begin() : to.items.end(), from.items.begin(), from.items.end());
+	for (auto& item : from.items)
+		m_index.modify(item.getId())->chunk = to.key;
+	removeChunk(chunk);
+}
+
+PlayQueue::PlayQueue()
+: m_head(0)
+, m_slots(0)
+, m_live(0)
+, m_index(Entry { TrackId(), 0, 0, 0 }, IdOf())
+{
+}
+
+const PlayQueue::Slot& PlayQueue::at(size_t i) const
+{
+	size_t position = m_head + i;
+	return (*m_chunks[position / ChunkSize])[position % ChunkSize];
+}
+
+bool PlayQueue::isLive(const Slot& slot) const
+{
+	const Entry* entry = m_index.find(slot.id);
+	return entry && entry->generation == slot.generation;
+}
 
-	while (!m_queue.empty())
+// every chunk but the last is full
+void PlayQueue::push(const TrackId& id)
+{
+	if (m_chunks.empty() || m_chunks.back()->size() == ChunkSize) {
+		m_chunks.push_back(std::make_shared<Chunk>());
+		m_chunks.back()->reserve(ChunkSize);
+	}
+	Entry* entry = m_index.modify(id);
+	if (!entry) {
+		m_index.insert(Entry { id, 0, 0, 0 });
+		entry = m_index.modify(id);
+	}
+	Slot slot;
+	slot.id = id;
+	slot.generation = entry->generation;
+	unshare(m_chunks.back()).push_back(slot);
+	entry->live++;
+	entry->slots++;
+	m_slots++;
+	m_live++;
+}
+
+// drop the slot at the head, the index entry goes with the last slot of a
+// track (so an old generation can never come back to life)
+void PlayQueue::drop()
+{
+	const Slot& slot = at(0);
+	Entry* entry = m_index.modify(slot.id);
+	if (entry->generation == slot.generation) {
+		entry->live--;
+		m_live--;
+	}
+	if (--entry->slots == 0)
+		m_index.erase(slot.id);
+	m_slots--;
+	if (!m_slots) {
+		m_chunks.clear();
+		m_head = 0;
+	} else if (++m_head == ChunkSize) {
+		m_chunks.pop_front();
+		m_head = 0;
+	}
+}
+
+bool PlayQueue::pop(TrackId& id)
+{
+	while (m_slots)
 	{
-		std::string item = *m_queue.begin();
-		m_queue.erase(m_queue.begin());
-		try {
-			auto& track = getTrack(item);
-			m_uuid = uuidgen();
-			return track;
-		} catch (...) {
-			// next
-		}
+		bool live = isLive(at(0));
+		id = at(0).id;
+		drop();
+		if (live)
+			return true;
 	}
+	return false;
+}
 
-	if (m_shuffle && !m_repeat)
+bool PlayQueue::front(TrackId& id)
+{
+	while (m_slots && !isLive(at(0)))
+		drop();
+	if (!m_slots)
+		return false;
+	id = at(0).id;
+	return true;
+}
+
+void PlayQueue::remove(const TrackId& id)
+{
+	Entry* entry = m_index.modify(id);
+	if (!entry || !entry->live)
+		return;
+	m_live -= entry->live;
+	entry->live = 0;
+	entry->generation++;
+}
+
+bool PlayQueue::contains(const TrackId& id) const
+{
+	const Entry* entry = m_index.find(id);
+	return entry && entry->live;
+}
+
+size_t PlayQueue::size() const
+{
+	return m_live;
+}
+
+std::vector<TrackId> PlayQueue::items() const
+{
+	std::vector<TrackId> items;
+	items.reserve(m_live);
+	for (size_t i = 0; i < m_slots; ++i)
 	{
-		std::random_device rd;
-		std::default_random_engine e1(rd());
-		std::uniform_int_distribution<size_t> uniform_dist(0, m_items.size() - 1);
-		size_t choosen = uniform_dist(e1);
+		const Slot& slot = at(i);
+		if (isLive(slot))
+			items.push_back(slot.id);
+	}
+	return items;
+}
 
-		// Improve the shuffle experience for users who does not appreciate true randomness
-		if (m_items.size() > 1)
-			while (m_items[choosen].getUUID() == uuid)
-				choosen = uniform_dist(e1);
+ShuffleBag::ShuffleBag()
+: m_left(0)
+, m_index((uint32_t)-1, IdOf { &m_slots })
+, m_history_size(0)
+{
+	std::random_device rd;
+	std::seed_seq seed { rd(), rd(), rd(), rd() };
+	m_engine.seed(seed);
+}
 
-		return m_items[choosen];
+// the index is updated first, it finds a track by its position
+void ShuffleBag::swap(size_t a, size_t b)
+{
+	if (a == b)
+		return;
+	uint32_t* first = m_index.find(m_slots[a]);
+	uint32_t* second = m_index.find(m_slots[b]);
+	*first = b;
+	*second = a;
+	std::swap(m_slots[a], m_slots[b]);
+}
+
+// a new track is put among those not drawn yet
+void ShuffleBag::insert(const TrackId& id)
+{
+	m_slots.push_back(id);
+	m_index.insert(m_slots.size() - 1);
+	swap(m_left, m_slots.size() - 1);
+	m_left++;
+}
+
+void ShuffleBag::reserve(size_t tracks)
+{
+	m_slots.reserve(m_slots.size() + tracks);
+	m_index.reserve(m_index.size() + tracks);
+}
+
+void ShuffleBag::remove(const TrackId& id)
+{
+	uint32_t* ptr = m_index.find(id);
+	if (!ptr)
+		return;
+	size_t pos = *ptr;
+	if (pos < m_left) {
+		swap(pos, m_left - 1);
+		pos = --m_left;
 	}
+	swap(pos, m_slots.size() - 1);
+	m_index.erase(m_index.find(id));
+	m_slots.pop_back();
+}
 
-	auto ptr = std::find_if(m_items.begin(), m_items.end(),
-			[&uuid](PlaylistItem const& item) {
-				return item.getUUID() == uuid;
-			});
-	if (ptr == m_items.end())
-		return m_items[0];
-	if (m_repeat)
-		return *ptr;
-	++ptr;
-	if (ptr == m_items.end()) {
-		if (!m_repeatall)
-			throw std::runtime_error("playlist done");
-		ptr = m_items.begin();
+bool ShuffleBag::recent(const TrackId& id) const
+{
+	return std::find(m_history.begin(), m_history.end(), id) != m_history.end();
+}
+
+bool ShuffleBag::draw(TrackId& id, const TrackId& current)
+{
+	if (m_slots.empty())
+		return false;
+	if (!m_left)
+		m_left = m_slots.size();
+
+	// the current track and recent draws are drawn again only if there is
+	// nothing else left this round
+	std::uniform_int_distribution<size_t> dist(0, m_left - 1);
+	size_t pick = dist(m_engine);
+	for (unsigned int i = 0; i < 16 && m_left > 1; ++i) {
+		if (m_slots[pick] != current && !recent(m_slots[pick]))
+			break;
+		pick = dist(m_engine);
+	}
+	swap(pick, m_left - 1);
+	id = m_slots[--m_left];
+
+	if (m_history_size) {
+		m_history.push_back(id);
+		while (m_history.size() > m_history_size)
+			m_history.pop_front();
 	}
-	return *ptr;
+	return true;
 }
 
-bool Playlist::getRepeat() const
+void ShuffleBag::setHistory(size_t history)
+{
+	m_history_size = history;
+	while (m_history.size() > m_history_size)
+		m_history.pop_front();
+}
+
+const PlaylistItem* PlaylistSnapshot::find(const TrackId& uuid) const
+{
+	return m_tracks->find(uuid);
+}
+
+const PlaylistItem& PlaylistSnapshot::getTrack(const TrackId& uuid) const
+{
+	const PlaylistItem* track = find(uuid);
+	if (!track)
+		throw std::runtime_error("track not found");
+	return *track;
+}
+
+const TrackList& PlaylistSnapshot::getTracks() const
+{
+	return *m_tracks;
+}
+
+std::vector<TrackId> PlaylistSnapshot::getQueue() const
+{
+	return m_queue.items();
+}
+
+bool PlaylistSnapshot::isQueued(const TrackId& uuid) const
+{
+	return m_queue.contains(uuid);
+}
+
+uint64_t PlaylistSnapshot::getVersion() const
+{
+	return m_version;
+}
+
+bool PlaylistSnapshot::getRepeat() const
 {
 	return m_repeat;
 }
 
-bool Playlist::getRepeatAll() const
+bool PlaylistSnapshot::getRepeatAll() const
 {
 	return m_repeatall;
 }
 
-bool Playlist::getShuffle() const
+bool PlaylistSnapshot::getShuffle() const
 {
 	return m_shuffle;
 }
 
-const std::vector<PlaylistItem>& Playlist::getTracks() const
+PlaylistOperation PlaylistOperation::insert(const PlaylistItem& item)
+{
+	PlaylistOperation operation;
+	operation.type = Insert;
+	operation.item = item;
+	operation.uuid = item.getId();
+	operation.value = false;
+	return operation;
+}
+
+PlaylistOperation PlaylistOperation::remove(const TrackId& uuid)
 {
-	return m_items;
+	PlaylistOperation operation;
+	operation.type = Remove;
+	operation.uuid = uuid;
+	operation.value = false;
+	return operation;
 }
 
-const std::vector<std::string>& Playlist::getQueue() const
+PlaylistOperation PlaylistOperation::queue(const TrackId& uuid)
 {
-	return m_queue;
+	PlaylistOperation operation;
+	operation.type = Queue;
+	operation.uuid = uuid;
+	operation.value = false;
+	return operation;
 }
 
-const std::string& Playlist::getUUID() const
+PlaylistOperation PlaylistOperation::dequeue()
 {
-	return m_uuid;
+	PlaylistOperation operation;
+	operation.type = Dequeue;
+	operation.value = false;
+	return operation;
+}
+
+PlaylistOperation PlaylistOperation::move(const TrackId& uuid, const TrackId& before)
+{
+	PlaylistOperation operation;
+	operation.type = Move;
+	operation.uuid = uuid;
+	operation.before = before;
+	operation.value = false;
+	return operation;
+}
+
+PlaylistOperation PlaylistOperation::repeat(bool value)
+{
+	PlaylistOperation operation;
+	operation.type = Repeat;
+	operation.value = value;
+	return operation;
+}
+
+PlaylistOperation PlaylistOperation::repeatAll(bool value)
+{
+	PlaylistOperation operation;
+	operation.type = RepeatAll;
+	operation.value = value;
+	return operation;
+}
+
+PlaylistOperation PlaylistOperation::shuffle(bool value)
+{
+	PlaylistOperation operation;
+	operation.type = Shuffle;
+	operation.value = value;
+	return operation;
+}
+
+Playlist::Lock::Lock(Playlist& playlist)
+: m_lock(playlist.m_mutex, std::defer_lock)
+{
+	auto begin = std::chrono::steady_clock::now();
+	m_lock.lock();
+	m_acquired = std::chrono::steady_clock::now();
+	metrics_timing("playlist.lock_wait", std::chrono::duration<double>(m_acquired - begin).count());
+}
+
+Playlist::Lock::~Lock()
+{
+	double held = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_acquired).count();
+	m_lock.unlock();
+	metrics_timing("playlist.lock_hold", held);
+}
+
+Playlist::Batch::Batch(Playlist& playlist)
+: m_playlist(playlist)
+{
+	m_playlist.m_batch++;
+}
+
+Playlist::Batch::~Batch()
+{
+	if (--m_playlist.m_batch == 0 && m_playlist.m_dirty)
+		m_playlist.publish();
+}
+
+Playlist::Playlist()
+: m_repeat(false)
+, m_repeatall(false)
+, m_shuffle(false)
+, m_version(1)
+, m_batch(0)
+, m_dirty(false)
+, m_tracks_dirty(true)
+{
+	publish();
+}
+
+void Playlist::changed(bool tracks)
+{
+	m_version++;
+	m_dirty = true;
+	if (tracks)
+		m_tracks_dirty = true;
+	if (!m_batch)
+		publish();
+}
+
+// the snapshot copies the chunk pointers of the tracks and the queue, the
+// next change then copies the chunk it touches. the tracks are only copied
+// if they changed, a change to the queue or the flags shares them with the
+// previous snapshot.
+void Playlist::publish()
+{
+	if (m_tracks_dirty) {
+		m_published = std::make_shared<TrackList>(m_tracks);
+		m_tracks_dirty = false;
+	}
+
+	std::shared_ptr<PlaylistSnapshot> snapshot = std::make_shared<PlaylistSnapshot>();
+	snapshot->m_version = m_version;
+	snapshot->m_repeat = m_repeat;
+	snapshot->m_repeatall = m_repeatall;
+	snapshot->m_shuffle = m_shuffle;
+	snapshot->m_tracks = m_published;
+	snapshot->m_queue = m_queue;
+	std::atomic_store(&m_snapshot, std::shared_ptr<const PlaylistSnapshot>(snapshot));
+	m_dirty = false;
+}
+
+std::shared_ptr<const PlaylistSnapshot> Playlist::getSnapshot() const
+{
+	return std::atomic_load(&m_snapshot);
+}
+
+// the operations are checked against the tracks there will be by then
+void Playlist::validate(const std::vector<PlaylistOperation>& operations) const
+{
+	// only inserts of tracks that are referred to later on are kept track
+	// of, a batch may insert a whole library
+	std::unordered_set<TrackId> referenced, added, removed;
+	for (auto& operation : operations)
+	{
+		if (operation.type == PlaylistOperation::Queue || operation.type == PlaylistOperation::Move)
+			referenced.insert(operation.uuid);
+		if (operation.type == PlaylistOperation::Move && !operation.before.empty())
+			referenced.insert(operation.before);
+	}
+	auto exists = [&](const TrackId& uuid) {
+		if (removed.count(uuid))
+			return false;
+		return added.count(uuid) || m_tracks.find(uuid);
+	};
+	for (auto& operation : operations)
+	{
+		switch (operation.type) {
+			case PlaylistOperation::Insert:
+				// the nil id marks the free slots of the index
+				if (operation.uuid.empty() || exists(operation.uuid))
+					throw std::runtime_error("invalid track");
+				if (referenced.count(operation.uuid))
+					added.insert(operation.uuid);
+				removed.erase(operation.uuid);
+				break;
+			case PlaylistOperation::Remove:
+				removed.insert(operation.uuid);
+				added.erase(operation.uuid);
+				break;
+			case PlaylistOperation::Move:
+				if (!operation.before.empty() && !exists(operation.before))
+					throw std::runtime_error("track not found");
+				// fall through
+			case PlaylistOperation::Queue:
+				if (!exists(operation.uuid))
+					throw std::runtime_error("track not found");
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+std::shared_ptr<const PlaylistSnapshot> Playlist::apply(const std::vector<PlaylistOperation>& operations)
+{
+	Lock lock(*this);
+	validate(operations);
+	{
+		Batch batch(*this);
+		size_t inserts = std::count_if(operations.begin(), operations.end(), [](const PlaylistOperation& operation) {
+				return operation.type == PlaylistOperation::Insert;
+			});
+		if (inserts > 1) {
+			m_tracks.reserve(inserts);
+			m_bag.reserve(inserts);
+		}
+		for (auto& operation : operations)
+		{
+			switch (operation.type) {
+				case PlaylistOperation::Insert:
+					insert(operation.item);
+					break;
+				case PlaylistOperation::Remove:
+					remove(operation.uuid);
+					break;
+				case PlaylistOperation::Queue:
+					queueTrack(operation.uuid);
+					break;
+				case PlaylistOperation::Dequeue:
+					dequeue();
+					break;
+				case PlaylistOperation::Move:
+					move(operation.uuid, operation.before);
+					break;
+				case PlaylistOperation::Repeat:
+					setRepeat(operation.value);
+					break;
+				case PlaylistOperation::RepeatAll:
+					setRepeatAll(operation.value);
+					break;
+				case PlaylistOperation::Shuffle:
+					setShuffle(operation.value);
+					break;
+			}
+		}
+	}
+	if (m_listener)
+		m_listener(operations, m_snapshot);
+	return m_snapshot;
+}
+
+// a track that is there already (inserted twice in a batch) is left as is
+void Playlist::insert(const PlaylistItem& item)
+{
+	if (item.getId().empty() || m_tracks.find(item.getId()))
+		return;
+	m_tracks.push_back(item);
+	m_bag.insert(item.getId());
+	changed(true);
+}
+
+void Playlist::remove(const TrackId& uuid)
+{
+	if (!m_tracks.find(uuid))
+		return;
+
+	m_queue.remove(uuid);
+	m_bag.remove(uuid);
+	m_tracks.erase(uuid);
+	changed(true);
+}
+
+void Playlist::queueTrack(const TrackId& uuid)
+{
+	m_queue.push(uuid);
+	changed();
+}
+
+void Playlist::dequeue()
+{
+	TrackId uuid;
+	if (m_queue.pop(uuid))
+		changed();
+}
+
+void Playlist::move(const TrackId& uuid, const TrackId& before)
+{
+	if (uuid == before)
+		return;
+	m_tracks.move(uuid, before);
+	changed(true);
+}
+
+const PlaylistItem& Playlist::getTrack(const TrackId& uuid) const
+{
+	const PlaylistItem* track = m_tracks.find(uuid);
+	if (!track)
+		throw std::runtime_error("track not found");
+	return *track;
+}
+
+// the track after uuid in order (or the first if uuid is unknown)
+const PlaylistItem& Playlist::next(const TrackId& uuid) const
+{
+	const PlaylistItem* track = m_tracks.find(uuid);
+	if (!track)
+		return m_tracks.front();
+	if (m_repeat)
+		return *track;
+	const PlaylistItem* next = m_tracks.next(uuid);
+	if (!next) {
+		if (!m_repeatall)
+			throw std::runtime_error("playlist done");
+		return m_tracks.front();
+	}
+	return *next;
+}
+
+PlaylistItem Playlist::getNextTrack(const TrackId& uuid)
+{
+	Lock lock(*this);
+	if (m_tracks.empty())
+		throw std::runtime_error("playlist is empty");
+
+	// removed tracks are gone from the queue too
+	TrackId item;
+	if (m_queue.pop(item)) {
+		changed();
+		if (m_listener)
+			m_listener({ PlaylistOperation::dequeue() }, m_snapshot);
+		return getTrack(item);
+	}
+
+	if (m_shuffle && !m_repeat)
+	{
+		// use the pick that was already announced by peekNextTrack
+		if (!m_shuffle_next.empty()) {
+			TrackId next = m_shuffle_next;
+			m_shuffle_next = TrackId();
+			if (next != uuid || m_tracks.size() == 1) {
+				try {
+					return getTrack(next);
+				} catch (...) {
+					// removed since
+				}
+			}
+		}
+		return shuffle(uuid);
+	}
+
+	return next(uuid);
+}
+
+// the track getNextTrack(uuid) is going to return, without consuming the
+// queue. a shuffle pick is drawn here and kept for getNextTrack.
+PlaylistItem Playlist::peekNextTrack(const TrackId& uuid)
+{
+	Lock lock(*this);
+	if (m_tracks.empty())
+		throw std::runtime_error("playlist is empty");
+
+	TrackId item;
+	if (m_queue.front(item))
+		return getTrack(item);
+
+	if (m_shuffle && !m_repeat)
+	{
+		if (!m_shuffle_next.empty() && (m_shuffle_next != uuid || m_tracks.size() == 1)) {
+			try {
+				return getTrack(m_shuffle_next);
+			} catch (...) {
+				// removed since
+			}
+		}
+		const PlaylistItem& track = shuffle(uuid);
+		m_shuffle_next = track.getId();
+		return track;
+	}
+
+	return next(uuid);
+}
+
+const PlaylistItem& Playlist::shuffle(const TrackId& uuid)
+{
+	TrackId id;
+	if (!m_bag.draw(id, uuid))
+		throw std::runtime_error("playlist is empty");
+	return getTrack(id);
 }
 
 void Playlist::setRepeat(bool value)
 {
-	if (m_repeat != value)
-		m_uuid = uuidgen();
+	if (m_repeat == value)
+		return;
 	m_repeat = value;
+	changed();
 }
 
 void Playlist::setRepeatAll(bool value)
 {
-	if (m_repeatall != value)
-		m_uuid = uuidgen();
+	if (m_repeatall == value)
+		return;
 	m_repeatall = value;
+	changed();
 }
 
 void Playlist::setShuffle(bool value)
 {
-	if (m_shuffle != value)
-		m_uuid = uuidgen();
+	if (m_shuffle == value)
+		return;
 	m_shuffle = value;
+	changed();
+}
+
+void Playlist::setShuffleHistory(size_t tracks)
+{
+	Lock lock(*this);
+	m_bag.setHistory(tracks);
 }
 
-std::mutex& Playlist::getMutex()
+void Playlist::setListener(const Listener& listener)
 {
-	return m_mutex;
+	Lock lock(*this);
+	m_listener = listener;
 }
@@ -1,53 +1,533 @@
 #ifndef _PLAYLIST_HPP_
 #define _PLAYLIST_HPP_
 
+#include "trackid.hpp"
 #include <string>
 #include <vector>
+#include <iterator>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
 #include <mutex>
+#include <chrono>
+#include <functional>
+#include <deque>
+#include <random>
+#include <stdint.h>
 
+// a handle of a fixed, small size: the path and name are kept in the path
+// arena (see patharena.hpp), which never frees them, so items are copied by
+// value instead of being shared.
 class PlaylistItem {
 	public:
+		PlaylistItem();
 		PlaylistItem(const std::string& path);
+		// the name is taken from the path if empty, a duration < 0 is unknown
+		PlaylistItem(const std::string& path, const TrackId& id,
+				const std::string& name = std::string(), double duration = -1);
 
-		const std::string& getName() const;
-		const std::string& getPath() const;
-		const std::string& getUUID() const;
+		std::string getName() const;
+		std::string getPath() const;
+		const TrackId& getId() const;
+		double getDuration() const;
 	private:
-		std::string m_uuid;
-		std::string m_name;
-		std::string m_path;
+		TrackId m_id;
+		uint32_t m_directory;
+		uint32_t m_file;
+		// only if it isn't the file name without its extension
+		uint32_t m_title;
+		float m_duration;
 };
 
-class Playlist {
+// a set of values that each stand for a track (GetId gives its id), kept in
+// a flat table instead of a node per track: linear probing, at most half
+// full, and a removal shifts the values after it back instead of leaving a
+// tombstone. the empty value marks a free slot.
+template <typename Value, typename GetId>
+class TrackIndex {
 	public:
-		Playlist();
+		TrackIndex(const Value& empty, const GetId& getId)
+		: m_empty(empty)
+		, m_get_id(getId)
+		, m_size(0)
+		{
+		}
 
-		void insert(const PlaylistItem& item);
-		bool remove(const std::string& uuid);
-		void queueTrack(const std::string& uuid);
-		const PlaylistItem& getTrack(const std::string& uuid) const;
-		const PlaylistItem& getNextTrack(const std::string& uuid = std::string()) const;
+		Value* find(const TrackId& id)
+		{
+			if (m_slots.empty())
+				return NULL;
+			size_t mask = m_slots.size() - 1;
+			for (size_t i = std::hash<TrackId>()(id) & mask; m_slots[i] != m_empty; i = (i + 1) & mask)
+			{
+				if (m_get_id(m_slots[i]) == id)
+					return &m_slots[i];
+			}
+			return NULL;
+		}
+
+		const Value* find(const TrackId& id) const
+		{
+			return const_cast<TrackIndex*>(this)->find(id);
+		}
+
+		// the track of value mustn't be in the index yet
+		void insert(const Value& value)
+		{
+			reserve(m_size + 1);
+			place(value);
+			m_size++;
+		}
+
+		// slot is what find returned
+		void erase(Value* slot)
+		{
+			size_t mask = m_slots.size() - 1;
+			size_t hole = slot - &m_slots[0];
+			for (size_t i = (hole + 1) & mask; m_slots[i] != m_empty; i = (i + 1) & mask)
+			{
+				// moved back if the hole is between its home slot and it
+				size_t home = std::hash<TrackId>()(m_get_id(m_slots[i])) & mask;
+				if (((i - home) & mask) >= ((i - hole) & mask)) {
+					m_slots[hole] = m_slots[i];
+					hole = i;
+				}
+			}
+			m_slots[hole] = m_empty;
+			m_size--;
+		}
+
+		void reserve(size_t size)
+		{
+			if (size * 2 <= m_slots.size())
+				return;
+			size_t slots = 16;
+			while (slots < size * 2)
+				slots *= 2;
+			std::vector<Value> old(slots, m_empty);
+			m_slots.swap(old);
+			for (auto& value : old)
+				if (value != m_empty)
+					place(value);
+		}
+
+		size_t size() const
+		{
+			return m_size;
+		}
+
+		// calls f with every value, in no particular order
+		template <typename F>
+		void each(F f) const
+		{
+			for (auto& value : m_slots)
+				if (value != m_empty)
+					f(value);
+		}
+	private:
+		void place(const Value& value)
+		{
+			size_t mask = m_slots.size() - 1;
+			size_t i = std::hash<TrackId>()(m_get_id(value)) & mask;
+			while (m_slots[i] != m_empty)
+				i = (i + 1) & mask;
+			m_slots[i] = value;
+		}
+
+		Value m_empty;
+		GetId m_get_id;
+		std::vector<Value> m_slots;
+		size_t m_size;
+};
+
+// the object behind ptr, copied first if anything else (a snapshot) holds it
+template <typename T>
+T& unshare(std::shared_ptr<T>& ptr)
+{
+	if (ptr.use_count() != 1)
+		ptr = std::make_shared<T>(*ptr);
+	return *ptr;
+}
+
+// a TrackIndex split into shards (by the upper bits of the hash) that are
+// shared between copies. a copy only copies the pointers, and a change
+// copies the one shard it touches unless nothing else holds it. the shards
+// are kept at about MaxShard values, so that copy is bounded.
+template <typename Value, typename GetId>
+class SharedIndex {
+	public:
+		SharedIndex(const Value& empty, const GetId& getId)
+		: m_empty(empty)
+		, m_get_id(getId)
+		, m_bits(0)
+		, m_size(0)
+		{
+			m_shards.push_back(std::make_shared<Shard>(m_empty, m_get_id));
+		}
+
+		const Value* find(const TrackId& id) const
+		{
+			return m_shards[shardOf(id)]->find(id);
+		}
+
+		// to change the value in place
+		Value* modify(const TrackId& id)
+		{
+			std::shared_ptr<Shard>& shard = m_shards[shardOf(id)];
+			if (!shard->find(id))
+				return NULL;
+			return unshare(shard).find(id);
+		}
+
+		// the track of value mustn't be in the index yet
+		void insert(const Value& value)
+		{
+			reserve(m_size + 1);
+			unshare(m_shards[shardOf(m_get_id(value))]).insert(value);
+			m_size++;
+		}
+
+		void erase(const TrackId& id)
+		{
+			std::shared_ptr<Shard>& shard = m_shards[shardOf(id)];
+			if (!shard->find(id))
+				return;
+			Shard& writable = unshare(shard);
+			writable.erase(writable.find(id));
+			m_size--;
+		}
+
+		// grows the number of shards (by rehashing everything) ahead of time
+		void reserve(size_t size)
+		{
+			size_t bits = m_bits;
+			while (size > ((size_t)MaxShard << bits))
+				bits += 2;
+			if (bits == m_bits)
+				return;
+			std::vector<std::shared_ptr<Shard>> shards;
+			for (size_t i = 0; i < ((size_t)1 << bits); ++i)
+				shards.push_back(std::make_shared<Shard>(m_empty, m_get_id));
+			for (auto& shard : m_shards)
+				shard->each([this, &shards, bits](const Value& value) {
+						shards[shardOf(m_get_id(value), bits)]->insert(value);
+					});
+			m_shards.swap(shards);
+			m_bits = bits;
+		}
+
+		size_t size() const
+		{
+			return m_size;
+		}
+	private:
+		typedef TrackIndex<Value, GetId> Shard;
+		enum { MaxShard = 1024 };
+
+		// TrackIndex uses the lower bits
+		static size_t shardOf(const TrackId& id, size_t bits)
+		{
+			return bits ? (size_t)((uint64_t)std::hash<TrackId>()(id) >> (64 - bits)) : 0;
+		}
+
+		size_t shardOf(const TrackId& id) const
+		{
+			return shardOf(id, m_bits);
+		}
+
+		Value m_empty;
+		GetId m_get_id;
+		std::vector<std::shared_ptr<Shard>> m_shards;
+		size_t m_bits;
+		size_t m_size;
+};
+
+// the tracks in order, in chunks that are shared between copies (as
+// SharedIndex does): a copy for a snapshot only copies the pointers, a
+// change copies the chunk it touches. the index maps a uuid to its chunk,
+// which is then searched, so a lookup is bounded by the chunk size.
+class TrackList {
+	public:
+		class Iterator : public std::iterator<std::forward_iterator_tag, const PlaylistItem> {
+			public:
+				Iterator(const TrackList* list, size_t chunk, size_t offset)
+				: m_list(list)
+				, m_chunk(chunk)
+				, m_offset(offset)
+				{
+				}
+				const PlaylistItem& operator*() const { return m_list->m_chunks[m_chunk]->items[m_offset]; }
+				const PlaylistItem* operator->() const { return &**this; }
+				Iterator& operator++()
+				{
+					if (++m_offset == m_list->m_chunks[m_chunk]->items.size()) {
+						m_chunk++;
+						m_offset = 0;
+					}
+					return *this;
+				}
+				bool operator==(const Iterator& other) const { return m_chunk == other.m_chunk && m_offset == other.m_offset; }
+				bool operator!=(const Iterator& other) const { return !(*this == other); }
+			private:
+				const TrackList* m_list;
+				size_t m_chunk;
+				size_t m_offset;
+		};
+
+		TrackList();
+
+		const PlaylistItem* find(const TrackId& uuid) const;
+		// the track after uuid, NULL if it is the last
+		const PlaylistItem* next(const TrackId& uuid) const;
+		const PlaylistItem& front() const;
+		const PlaylistItem& back() const;
+		Iterator begin() const;
+		Iterator end() const;
+		size_t size() const;
+		bool empty() const;
+
+		// the uuid of item mustn't be there yet
+		void push_back(const PlaylistItem& item);
+		void erase(const TrackId& uuid);
+		// in front of before, or to the end if that is the nil id
+		void move(const TrackId& uuid, const TrackId& before);
+		void reserve(size_t tracks);
+	private:
+		// chunks are filled up to ChunkSize by appending, split once they
+		// grow past twice that, and merged below a quarter of it into the
+		// next (or else the previous) chunk if that stays within ChunkSize
+		enum { ChunkSize = 256 };
+		struct Chunk {
+			uint32_t key;
+			std::vector<PlaylistItem> items;
+		};
+		// the key of a chunk stays the same when it is copied or moves
+		struct Entry {
+			TrackId id;
+			uint32_t chunk;
+			bool operator!=(const Entry& other) const { return id != other.id; }
+		};
+		struct IdOf {
+			const TrackId& operator()(const Entry& entry) const { return entry.id; }
+		};
+
+		bool locate(const TrackId& uuid, size_t& chunk, size_t& offset) const;
+		void insert(size_t chunk, size_t offset, const PlaylistItem& item);
+		void addChunk(size_t position);
+		void removeChunk(size_t position);
+		void split(size_t chunk);
+		void merge(size_t chunk);
+		void reposition(size_t from);
+
+		std::vector<std::shared_ptr<Chunk>> m_chunks;
+		// the position of each chunk in m_chunks by its key
+		std::vector<uint32_t> m_positions;
+		std::vector<uint32_t> m_free_keys;
+		SharedIndex<Entry, IdOf> m_index;
+		size_t m_size;
+};
+
+// the play queue, a queue of track ids with an index of what is queued.
+// removing a track only bumps its generation in the index, the entries it
+// had in the queue are dropped as they come up. both are shared between
+// copies like TrackList, so a snapshot of the queue takes no copy of it.
+class PlayQueue {
+	public:
+		PlayQueue();
+
+		void push(const TrackId& id);
+		bool pop(TrackId& id);
+		bool front(TrackId& id);
+		void remove(const TrackId& id);
+		bool contains(const TrackId& id) const;
+		size_t size() const;
+		std::vector<TrackId> items() const;
+	private:
+		struct Slot {
+			TrackId id;
+			uint64_t generation;
+		};
+		struct Entry {
+			TrackId id;
+			uint64_t generation;
+			size_t live;
+			size_t slots;
+			bool operator!=(const Entry& other) const { return id != other.id; }
+		};
+		struct IdOf {
+			const TrackId& operator()(const Entry& entry) const { return entry.id; }
+		};
+		enum { ChunkSize = 64 };
+		typedef std::vector<Slot> Chunk;
+
+		// the slot i after the head
+		const Slot& at(size_t i) const;
+		bool isLive(const Slot& slot) const;
+		void drop();
+
+		// m_head is in the first chunk
+		std::deque<std::shared_ptr<Chunk>> m_chunks;
+		size_t m_head;
+		size_t m_slots;
+		size_t m_live;
+		SharedIndex<Entry, IdOf> m_index;
+};
+
+// shuffle without repeats: the tracks are kept in a permutation whose front
+// part hasn't been drawn yet this round. a draw swaps a random one of those
+// to the end of that part (a Fisher-Yates step), a new round starts once
+// all are drawn. the last history draws are not drawn again right away.
+class ShuffleBag {
+	public:
+		ShuffleBag();
+
+		void insert(const TrackId& id);
+		void remove(const TrackId& id);
+		void reserve(size_t tracks);
+		bool draw(TrackId& id, const TrackId& current);
+		void setHistory(size_t history);
+	private:
+		// the track at a position in m_slots
+		struct IdOf {
+			const std::vector<TrackId>* slots;
+			const TrackId& operator()(uint32_t position) const { return (*slots)[position]; }
+		};
+
+		void swap(size_t a, size_t b);
+		bool recent(const TrackId& id) const;
 
+		std::vector<TrackId> m_slots;
+		size_t m_left;
+		TrackIndex<uint32_t, IdOf> m_index;
+		size_t m_history_size;
+		std::deque<TrackId> m_history;
+		std::mt19937_64 m_engine;
+};
+
+// an immutable view of the playlist. readers take the current one without
+// locking and keep it as long as they like, writers publish a new one. it
+// shares what didn't change with the playlist and the other snapshots.
+class PlaylistSnapshot {
+	public:
+		const PlaylistItem* find(const TrackId& uuid) const;
+		const PlaylistItem& getTrack(const TrackId& uuid) const;
+		const TrackList& getTracks() const;
+		std::vector<TrackId> getQueue() const;
+		bool isQueued(const TrackId& uuid) const;
+		uint64_t getVersion() const;
 		bool getRepeat() const;
 		bool getRepeatAll() const;
 		bool getShuffle() const;
-		const std::vector<PlaylistItem>& getTracks() const;
-		const std::vector<std::string>& getQueue() const;
-		const std::string& getUUID() const;
+	private:
+		friend class Playlist;
+
+		uint64_t m_version;
+		bool m_repeat;
+		bool m_repeatall;
+		bool m_shuffle;
+		// the same for the snapshots in between changes to the tracks
+		std::shared_ptr<const TrackList> m_tracks;
+		PlayQueue m_queue;
+};
+
+// a change to the playlist, see Playlist::apply
+struct PlaylistOperation {
+	enum Type { Insert, Remove, Queue, Dequeue, Move, Repeat, RepeatAll, Shuffle };
+
+	static PlaylistOperation insert(const PlaylistItem& item);
+	static PlaylistOperation remove(const TrackId& uuid);
+	static PlaylistOperation queue(const TrackId& uuid);
+	// the track at the front of the play queue is taken off it
+	static PlaylistOperation dequeue();
+	// in front of before, or to the end if that is the nil id
+	static PlaylistOperation move(const TrackId& uuid, const TrackId& before);
+	static PlaylistOperation repeat(bool value);
+	static PlaylistOperation repeatAll(bool value);
+	static PlaylistOperation shuffle(bool value);
+
+	Type type;
+	PlaylistItem item;
+	TrackId uuid;
+	TrackId before;
+	bool value;
+};
+
+// the tracks are kept in order in a TrackList, which makes lookup and
+// removal bounded by its chunk size. publishing a change copies a pointer
+// per chunk and the chunks the change touched, not the tracks. every
+// change bumps the version, so clients can tell if they are out of date.
+// changes are made in batches (apply) that publish a single new snapshot,
+// the lock is never held by callers.
+class Playlist {
+	public:
+		// called with the operations of every change that was made and the
+		// snapshot it published, in order and with the lock held
+		typedef std::function<void(const std::vector<PlaylistOperation>& operations,
+				const std::shared_ptr<const PlaylistSnapshot>& snapshot)> Listener;
 
+		Playlist();
+
+		// all of the operations are applied or (if one of them refers to a
+		// track that isn't there) none, throws std::runtime_error then
+		std::shared_ptr<const PlaylistSnapshot> apply(const std::vector<PlaylistOperation>& operations);
+		PlaylistItem getNextTrack(const TrackId& uuid = TrackId());
+		PlaylistItem peekNextTrack(const TrackId& uuid = TrackId());
+		std::shared_ptr<const PlaylistSnapshot> getSnapshot() const;
+		void setShuffleHistory(size_t tracks);
+		void setListener(const Listener& listener);
+	private:
+		// the mutex, with the time spent waiting for it and holding it
+		// reported as metrics
+		class Lock {
+			public:
+				Lock(Playlist& playlist);
+				~Lock();
+			private:
+				std::unique_lock<std::mutex> m_lock;
+				std::chrono::steady_clock::time_point m_acquired;
+		};
+
+		// changes made while a batch is alive are published when it ends
+		class Batch {
+			public:
+				Batch(Playlist& playlist);
+				~Batch();
+			private:
+				Playlist& m_playlist;
+		};
+
+		void validate(const std::vector<PlaylistOperation>& operations) const;
+		void insert(const PlaylistItem& item);
+		void remove(const TrackId& uuid);
+		void queueTrack(const TrackId& uuid);
+		void dequeue();
+		void move(const TrackId& uuid, const TrackId& before);
 		void setRepeat(bool value);
 		void setRepeatAll(bool value);
 		void setShuffle(bool value);
 
-		std::mutex& getMutex();
-	private:
+		const PlaylistItem& getTrack(const TrackId& uuid) const;
+		const PlaylistItem& shuffle(const TrackId& uuid);
+		const PlaylistItem& next(const TrackId& uuid) const;
+		void changed(bool tracks = false);
+		void publish();
+
 		bool m_repeat;
 		bool m_repeatall;
 		bool m_shuffle;
-		mutable std::vector<std::string> m_queue;
-		std::vector<PlaylistItem> m_items;
-		mutable std::string m_uuid;
+		PlayQueue m_queue;
+		TrackList m_tracks;
+		uint64_t m_version;
+		TrackId m_shuffle_next;
+		ShuffleBag m_bag;
 		std::mutex m_mutex;
+
+		unsigned int m_batch;
+		bool m_dirty;
+		bool m_tracks_dirty;
+		std::shared_ptr<const TrackList> m_published;
+		std::shared_ptr<const PlaylistSnapshot> m_snapshot;
+		Listener m_listener;
 };
 
 #endif
@@ -0,0 +1,275 @@
+#include "playlistfile.hpp"
+#include "metrics.hpp"
+#include "patharena.hpp"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <exception>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <syslog.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+	struct Slice {
+		const char* data;
+		size_t size;
+	};
+
+	// a track as found in the file, the items are made from these
+	struct Entry {
+		Slice path;
+		Slice title;
+		double duration;
+	};
+}
+
+// the offset of every '\n' in data
+static void split_lines(const char* data, size_t size, std::vector<size_t>& ends)
+{
+	size_t i = 0;
+#if defined(__SSE2__)
+	__m128i newline = _mm_set1_epi8('\n');
+	for (; i + 16 <= size; i += 16)
+	{
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i)), newline));
+		while (mask) {
+			ends.push_back(i + __builtin_ctz(mask));
+			mask &= mask - 1;
+		}
+	}
+#endif
+	while (i < size)
+	{
+		const char* eol = (const char*)memchr(data + i, '\n', size - i);
+		if (!eol)
+			break;
+		ends.push_back(eol - data);
+		i = eol - data + 1;
+	}
+}
+
+static Slice trim(const char* begin, const char* end)
+{
+	while (begin < end && (*begin == ' ' || *begin == '\t'))
+		++begin;
+	while (end > begin && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t'))
+		--end;
+	Slice slice = { begin, (size_t)(end - begin) };
+	return slice;
+}
+
+static bool starts_with(const Slice& line, const char* prefix)
+{
+	size_t len = strlen(prefix);
+	return line.size >= len && strncasecmp(line.data, prefix, len) == 0;
+}
+
+// the text is mapped, and not terminated
+static double parse_number(const char* data, size_t size)
+{
+	char buf[32];
+	size = std::min(size, sizeof buf - 1);
+	memcpy(buf, data, size);
+	buf[size] = '\0';
+	char* end;
+	double value = strtod(buf, &end);
+	return end == buf ? -1 : value;
+}
+
+// #EXTINF:<duration> [attributes],<title>, a comma in a quoted attribute
+// doesn't start the title
+static void parse_extinf(const Slice& line, Slice& title, double& duration)
+{
+	const char* p = line.data + 8;
+	const char* end = line.data + line.size;
+	duration = parse_number(p, end - p);
+	bool quoted = false;
+	for (; p < end; ++p)
+	{
+		if (*p == '"')
+			quoted = !quoted;
+		else if (*p == ',' && !quoted)
+			break;
+	}
+	title = p < end ? trim(p + 1, end) : Slice();
+}
+
+static void parse_m3u(const std::vector<Slice>& lines, std::vector<Entry>& entries)
+{
+	Slice title = Slice();
+	double duration = -1;
+	for (auto& line : lines)
+	{
+		if (!line.size)
+			continue;
+		if (line.data[0] == '#') {
+			if (starts_with(line, "#EXTINF:"))
+				parse_extinf(line, title, duration);
+			continue;
+		}
+		Entry entry = { line, title, duration };
+		entries.push_back(entry);
+		title = Slice();
+		duration = -1;
+	}
+}
+
+// [playlist] with FileN=, TitleN= and LengthN= in any order
+static void parse_pls(const std::vector<Slice>& lines, std::vector<Entry>& entries)
+{
+	std::vector<Entry> numbered;
+	for (auto& line : lines)
+	{
+		const char* eq = (const char*)memchr(line.data, '=', line.size);
+		if (!eq)
+			continue;
+		Slice key = trim(line.data, eq);
+		Slice value = trim(eq + 1, line.data + line.size);
+		size_t skip;
+		if (starts_with(key, "File"))
+			skip = 4;
+		else if (starts_with(key, "Title"))
+			skip = 5;
+		else if (starts_with(key, "Length"))
+			skip = 6;
+		else
+			continue;
+		double number = parse_number(key.data + skip, key.size - skip);
+		if (number < 1 || number > lines.size())
+			continue;
+		size_t index = (size_t)number - 1;
+		if (index >= numbered.size()) {
+			Entry empty = { Slice(), Slice(), -1 };
+			numbered.resize(index + 1, empty);
+		}
+		if (skip == 4)
+			numbered[index].path = value;
+		else if (skip == 5)
+			numbered[index].title = value;
+		else
+			numbered[index].duration = parse_number(value.data, value.size);
+	}
+	for (auto& entry : numbered)
+		if (entry.path.size)
+			entries.push_back(entry);
+}
+
+static std::string resolve(const Slice& path, const std::string& dir)
+{
+	std::string result(path.data, path.size);
+	if (result.compare(0, 7, "file://") == 0)
+		result.erase(0, 7);
+	else if (result[0] != '/' && result.find("://") == std::string::npos)
+		result = dir + "/" + result;
+	return result;
+}
+
+std::vector<PlaylistItem> playlist_read(const std::string& path)
+{
+	auto begin = std::chrono::steady_clock::now();
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+		throw std::runtime_error(path + ": " + strerror(errno));
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		throw std::runtime_error(path + ": " + strerror(errno));
+	}
+	std::vector<PlaylistItem> items;
+	if (st.st_size == 0) {
+		close(fd);
+		return items;
+	}
+	const char* data = (const char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		throw std::runtime_error(path + ": " + strerror(errno));
+	madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+	size_t size = st.st_size;
+
+	std::vector<size_t> ends;
+	ends.reserve(size / 64);
+	split_lines(data, size, ends);
+	std::vector<Slice> lines;
+	lines.reserve(ends.size() + 1);
+	size_t start = size >= 3 && memcmp(data, "\xef\xbb\xbf", 3) == 0 ? 3 : 0;
+	for (size_t end : ends)
+	{
+		lines.push_back(trim(data + start, data + end));
+		start = end + 1;
+	}
+	if (start < size)
+		lines.push_back(trim(data + start, data + size));
+
+	std::vector<Entry> entries;
+	entries.reserve(lines.size());
+	std::string::size_type dot = path.find_last_of('.');
+	bool pls = (dot != std::string::npos && strcasecmp(path.c_str() + dot, ".pls") == 0) ||
+		(!lines.empty() && starts_with(lines[0], "[playlist]"));
+	if (pls)
+		parse_pls(lines, entries);
+	else
+		parse_m3u(lines, entries);
+
+	// a path the arena can't hold is skipped, not the whole file
+	size_t valid = 0;
+	for (auto& entry : entries)
+		if (PathArena::isValid(entry.path.data, entry.path.size))
+			entries[valid++] = entry;
+	if (valid != entries.size())
+		syslog(LOG_WARNING, "Skipped %zu paths that are too long in %s", entries.size() - valid, path.c_str());
+	entries.resize(valid);
+
+	// the items (strings and ids) are made in parallel, each worker has its
+	// own engine for the ids. a failure (the arena is full) is passed on to
+	// this thread.
+	std::string dir = path.find('/') == std::string::npos ? "." : path.substr(0, path.find_last_of('/'));
+	items.resize(entries.size());
+	size_t workers = std::max(1u, std::thread::hardware_concurrency());
+	workers = std::min(workers, entries.size() / 10000 + 1);
+	std::vector<std::exception_ptr> errors(workers);
+	auto build = [&entries, &items, &dir, &errors](size_t worker, size_t from, size_t to) {
+		try {
+			std::random_device rd;
+			std::seed_seq seed { rd(), rd(), rd(), rd() };
+			std::mt19937_64 engine(seed);
+			for (size_t i = from; i < to; ++i)
+			{
+				const Entry& entry = entries[i];
+				std::string title = entry.title.size ? std::string(entry.title.data, entry.title.size) : std::string();
+				items[i] = PlaylistItem(resolve(entry.path, dir), TrackId::generate(engine),
+						title, entry.duration);
+			}
+		} catch (...) {
+			errors[worker] = std::current_exception();
+		}
+	};
+	std::vector<std::thread> threads;
+	size_t chunk = (entries.size() + workers - 1) / workers;
+	for (size_t i = 1; i < workers; ++i)
+		threads.push_back(std::thread(build, i, std::min(i * chunk, entries.size()), std::min((i + 1) * chunk, entries.size())));
+	build(0, 0, std::min(chunk, entries.size()));
+	for (auto& thread : threads)
+		thread.join();
+	munmap((void*)data, size);
+	for (auto& error : errors)
+		if (error)
+			std::rethrow_exception(error);
+
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	syslog(LOG_DEBUG, "Read %zu tracks from %s in %.0fms", items.size(), path.c_str(), elapsed * 1000);
+	metrics_timing("playlist.read", elapsed);
+	return items;
+}
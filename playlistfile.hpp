@@ -0,0 +1,13 @@
+#ifndef _PLAYLISTFILE_HPP_
+#define _PLAYLISTFILE_HPP_
+
+#include "playlist.hpp"
+#include <string>
+#include <vector>
+
+// reads an M3U/M3U8 (with #EXTINF titles and durations) or PLS playlist, or
+// a plain list of paths, relative paths are taken relative to the file.
+// throws std::runtime_error if it can't be read.
+std::vector<PlaylistItem> playlist_read(const std::string& path);
+
+#endif
@@ -0,0 +1,226 @@
+#include "process.hpp"
+#include "metrics.hpp"
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <cstring>
+#include <cerrno>
+#include <syslog.h>
+
+extern char** environ;
+
+struct ProcessState
+{
+	bool exited;
+	int status;
+};
+
+static std::mutex g_mutex;
+static std::condition_variable g_cond;
+static std::map<pid_t, ProcessState> g_processes;
+
+static void reaper()
+{
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	while (true)
+	{
+		int sig;
+		sigwait(&set, &sig);
+
+		std::lock_guard<std::mutex> lock(g_mutex);
+		pid_t pid;
+		int status;
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		{
+			auto ptr = g_processes.find(pid);
+			if (ptr == g_processes.end())
+				continue;
+			ptr->second.exited = true;
+			ptr->second.status = status;
+		}
+		g_cond.notify_all();
+	}
+}
+
+void process_init()
+{
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	std::thread(reaper).detach();
+}
+
+// with g_mutex held
+static bool cloexec_pipe(int fds[2])
+{
+	if (pipe(fds) != 0) {
+		fds[0] = fds[1] = -1;
+		return false;
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	return true;
+}
+
+pid_t process_spawn(const std::vector<std::string>& args, int* in, int* out, int* err, int* extra)
+{
+	std::vector<const char*> cbuf;
+	for (auto& a : args)
+		cbuf.push_back(a.c_str());
+	cbuf.push_back(0);
+
+	std::string cmd;
+	for (auto i: cbuf) { if (i != cbuf[0]) cmd += " "; if (i) cmd += i; }
+	syslog(LOG_DEBUG, "Command: %s", cmd.c_str());
+
+	int* fds[4] = { in, out, err, extra };
+	int pipes[4][2] = { { -1, -1 }, { -1, -1 }, { -1, -1 }, { -1, -1 } };
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+
+	// we ignore SIGPIPE and block SIGCHLD, the child should not
+	sigset_t mask, def;
+	sigemptyset(&mask);
+	sigemptyset(&def);
+	sigaddset(&def, SIGPIPE);
+	sigaddset(&def, SIGCHLD);
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setsigdefault(&attr, &def);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	pid_t pid;
+	int r = 0;
+	{
+		// the pipes are made with the lock held (which every spawn takes), so
+		// no other child can inherit them before both ends are close-on-exec.
+		// the reaper may not reap the child before it's registered either.
+		std::lock_guard<std::mutex> lock(g_mutex);
+		for (int i = 0; i < 4 && r == 0; ++i) {
+			if (!fds[i]) {
+				if (i < 3)
+					posix_spawn_file_actions_addopen(&actions, i, "/dev/null", i == 0 ? O_RDONLY : O_WRONLY, 0);
+				continue;
+			}
+			if (!cloexec_pipe(pipes[i])) {
+				r = errno;
+				break;
+			}
+			// dup2 clears close-on-exec on the child's copy, which needs
+			// another fd if its end already is the one it should get
+			int& child = pipes[i][i == 0 ? 0 : 1];
+			if (child == i) {
+				int fd = fcntl(child, F_DUPFD, 4);
+				if (fd == -1) {
+					r = errno;
+					break;
+				}
+				fcntl(fd, F_SETFD, FD_CLOEXEC);
+				close(child);
+				child = fd;
+			}
+			posix_spawn_file_actions_adddup2(&actions, child, i);
+		}
+		if (r == 0) {
+			auto begin = std::chrono::steady_clock::now();
+			r = posix_spawnp(&pid, cbuf[0], &actions, &attr, (char* const*)&cbuf[0], environ);
+			metrics_timing("process.spawn", std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+		}
+		if (r == 0) {
+			ProcessState state;
+			state.exited = false;
+			state.status = 0;
+			g_processes[pid] = state;
+		}
+	}
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	for (int i = 0; i < 4; ++i) {
+		if (!fds[i])
+			continue;
+		if (pipes[i][0] == -1 || pipes[i][1] == -1) {
+			close(pipes[i][0]);
+			close(pipes[i][1]);
+			*fds[i] = -1;
+			continue;
+		}
+		close(i == 0 ? pipes[i][0] : pipes[i][1]);
+		*fds[i] = i == 0 ? pipes[i][1] : pipes[i][0];
+	}
+
+	if (r != 0) {
+		syslog(LOG_ERR, "posix_spawn %s failed: %s", cbuf[0], strerror(r));
+		metrics_count("process.spawn_failed");
+		// the child's ends are closed, so callers will see EOF/EPIPE (or
+		// EBADF on the pipes that couldn't be made)
+		return -1;
+	}
+	metrics_count("process.spawned");
+	return pid;
+}
+
+bool process_kill(pid_t pid, int signal)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	auto ptr = g_processes.find(pid);
+	if (ptr == g_processes.end() || ptr->second.exited)
+		return false;
+	return ::kill(pid, signal) == 0;
+}
+
+bool process_renice(pid_t pid, int nice)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	auto ptr = g_processes.find(pid);
+	if (ptr == g_processes.end() || ptr->second.exited)
+		return false;
+	return setpriority(PRIO_PROCESS, pid, nice) == 0;
+}
+
+bool process_running(pid_t pid)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	auto ptr = g_processes.find(pid);
+	return ptr != g_processes.end() && !ptr->second.exited;
+}
+
+int process_wait(pid_t pid)
+{
+	std::unique_lock<std::mutex> lock(g_mutex);
+	auto ptr = g_processes.find(pid);
+	if (ptr == g_processes.end())
+		return -1;
+	g_cond.wait(lock, [pid]() {
+			return g_processes[pid].exited;
+		});
+	int status = g_processes[pid].status;
+	g_processes.erase(pid);
+	return status;
+}
+
+std::string process_run(const std::vector<std::string>& args, bool _stdout)
+{
+	int fd;
+	pid_t pid = _stdout ? process_spawn(args, NULL, &fd, NULL) : process_spawn(args, NULL, NULL, &fd);
+	char buf[1024];
+	int r;
+	std::string result;
+	while ((r = read(fd, buf, sizeof buf)) > 0)
+		result.append(buf, r);
+	close(fd);
+	process_wait(pid);
+	return result;
+}
@@ -0,0 +1,28 @@
+#ifndef _PROCESS_HPP_
+#define _PROCESS_HPP_
+
+#include <sys/types.h>
+#include <signal.h>
+#include <string>
+#include <vector>
+
+// child processes are started with posix_spawn (instead of forking the whole
+// server) and reaped by a single SIGCHLD watcher thread, process_init() has
+// to be called before any other thread is started.
+void process_init();
+
+// spawn args[0] (searched in $PATH) with stdin/stdout/stderr connected to
+// pipes if in/out/err is given, otherwise to /dev/null. if extra is given
+// the child gets a fourth pipe (to write to) as fd 3. returns -1 if it
+// fails, the pipes are at EOF then (or -1 if they couldn't be made).
+pid_t process_spawn(const std::vector<std::string>& args, int* in = NULL, int* out = NULL, int* err = NULL,
+		int* extra = NULL);
+bool process_kill(pid_t pid, int signal = SIGKILL);
+bool process_running(pid_t pid);
+bool process_renice(pid_t pid, int nice);
+int process_wait(pid_t pid);
+
+// run args and return its stdout (or stderr)
+std::string process_run(const std::vector<std::string>& args, bool _stdout = true);
+
+#endif
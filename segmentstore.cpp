@@ -0,0 +1,161 @@
+#include "segmentstore.hpp"
+#include <cmath>
+#include <syslog.h>
+
+static std::string setOf(const std::string& name)
+{
+	return name.substr(0, name.find('/'));
+}
+
+SegmentStore::SegmentStore(size_t maxSize)
+: m_size(0)
+, m_maxSize(maxSize)
+{
+}
+
+// the set of name is created if need be, writes by the job don't count as
+// reads (a job nobody reads is stopped)
+SegmentStore::Set& SegmentStore::touch(const std::string& name, bool read)
+{
+	std::string set = setOf(name);
+	auto ptr = m_sets.find(set);
+	if (ptr == m_sets.end()) {
+		Set entry;
+		entry.size = 0;
+		entry.pinned = false;
+		entry.read = std::chrono::steady_clock::now();
+		entry.lru = m_lru.insert(m_lru.end(), set);
+		ptr = m_sets.insert(std::make_pair(set, entry)).first;
+	} else
+		m_lru.splice(m_lru.end(), m_lru, ptr->second.lru);
+	if (read)
+		ptr->second.read = std::chrono::steady_clock::now();
+	return ptr->second;
+}
+
+void SegmentStore::put(const std::string& name, const std::string& data)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	Set& set = touch(name, false);
+	std::shared_ptr<const std::string>& entry = m_entries[name];
+	if (entry) {
+		set.size -= entry->size();
+		m_size -= entry->size();
+	}
+	entry = std::make_shared<const std::string>(data);
+	set.size += data.size();
+	m_size += data.size();
+
+	evict();
+	m_cond.notify_all();
+}
+
+std::shared_ptr<const std::string> SegmentStore::get(const std::string& name)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto ptr = m_entries.find(name);
+	if (ptr == m_entries.end())
+		return std::shared_ptr<const std::string>();
+	touch(name, true);
+	return ptr->second;
+}
+
+std::shared_ptr<const std::string> SegmentStore::wait(const std::string& name, unsigned int timeout)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	m_cond.wait_for(lock, std::chrono::seconds(timeout), [this, &name]() {
+			return m_entries.find(name) != m_entries.end();
+		});
+	auto ptr = m_entries.find(name);
+	if (ptr == m_entries.end())
+		return std::shared_ptr<const std::string>();
+	touch(name, true);
+	return ptr->second;
+}
+
+bool SegmentStore::contains(const std::string& name) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_entries.find(name) != m_entries.end();
+}
+
+void SegmentStore::remove(const std::string& set)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	erase(set);
+}
+
+void SegmentStore::erase(const std::string& set)
+{
+	std::string prefix = set + "/";
+	auto ptr = m_entries.lower_bound(prefix);
+	while (ptr != m_entries.end() && ptr->first.compare(0, prefix.size(), prefix) == 0) {
+		m_size -= ptr->second->size();
+		ptr = m_entries.erase(ptr);
+	}
+	auto entry = m_sets.find(set);
+	if (entry != m_sets.end()) {
+		m_lru.erase(entry->second.lru);
+		m_sets.erase(entry);
+	}
+}
+
+void SegmentStore::pin(const std::string& set, bool pinned)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (pinned)
+		touch(set, true).pinned = true;
+	else {
+		auto ptr = m_sets.find(set);
+		if (ptr != m_sets.end())
+			ptr->second.pinned = false;
+		evict();
+	}
+}
+
+double SegmentStore::idle(const std::string& set) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto ptr = m_sets.find(set);
+	if (ptr == m_sets.end())
+		return HUGE_VAL;
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - ptr->second.read).count();
+}
+
+void SegmentStore::setMaxSize(size_t maxSize)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_maxSize = maxSize;
+	evict();
+}
+
+size_t SegmentStore::getMaxSize() const
+{
+	return m_maxSize;
+}
+
+size_t SegmentStore::getSize() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_size;
+}
+
+// the store stays over its max size if every set is pinned or being read
+void SegmentStore::evict()
+{
+	auto now = std::chrono::steady_clock::now();
+	for (auto i = m_lru.begin(); m_size > m_maxSize && i != m_lru.end();)
+	{
+		const Set& set = m_sets[*i];
+		if (set.pinned || now - set.read < std::chrono::seconds(ReadingSeconds)) {
+			++i;
+			continue;
+		}
+		std::string name = *i++;
+		syslog(LOG_DEBUG, "Evicting HLS segments of %s", name.c_str());
+		erase(name);
+	}
+}
@@ -0,0 +1,58 @@
+#ifndef _SEGMENTSTORE_HPP_
+#define _SEGMENTSTORE_HPP_
+
+#include <string>
+#include <memory>
+#include <list>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+
+// in-memory storage for HLS playlists and segments, named "set/file" with a
+// set per track. once the store grows beyond its max size whole sets are
+// evicted (least recently used first), a set is never evicted while it is
+// pinned (its job is still writing it) or being read, so a playlist never
+// lists segments that are gone.
+class SegmentStore {
+	public:
+		SegmentStore(size_t maxSize = 512 * 1024 * 1024);
+
+		void put(const std::string& name, const std::string& data);
+		std::shared_ptr<const std::string> get(const std::string& name);
+		std::shared_ptr<const std::string> wait(const std::string& name, unsigned int timeout);
+		bool contains(const std::string& name) const;
+		// drops a set and everything in it
+		void remove(const std::string& set);
+
+		void pin(const std::string& set, bool pinned);
+		// seconds since anything in set was read (or it was pinned)
+		double idle(const std::string& set) const;
+
+		void setMaxSize(size_t maxSize);
+		size_t getMaxSize() const;
+		size_t getSize() const;
+	private:
+		// read within this many seconds
+		enum { ReadingSeconds = 60 };
+		struct Set {
+			size_t size;
+			bool pinned;
+			std::chrono::steady_clock::time_point read;
+			std::list<std::string>::iterator lru;
+		};
+
+		Set& touch(const std::string& name, bool read);
+		void erase(const std::string& set);
+		void evict();
+
+		std::map<std::string, std::shared_ptr<const std::string>> m_entries;
+		std::map<std::string, Set> m_sets;
+		std::list<std::string> m_lru;
+		size_t m_size;
+		size_t m_maxSize;
+		mutable std::mutex m_mutex;
+		std::condition_variable m_cond;
+};
+
+#endif
@@ -0,0 +1,451 @@
+#include "subtitles.hpp"
+#include "metrics.hpp"
+#include "charset.hpp"
+#include "process.hpp"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fstream>
+#include <streambuf>
+#include <stdexcept>
+#include <chrono>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <syslog.h>
+#include <thread>
+
+extern const char* ffmpegpath();
+
+// [HH:]MM:SS[,.]mmm
+static int64_t parseTimestamp(const std::string& line, size_t& pos)
+{
+	while (pos < line.size() && line[pos] == ' ')
+		++pos;
+
+	int64_t fields[3] = { 0, 0, 0 };
+	int n = 0;
+	while (n < 3)
+	{
+		size_t digits = 0;
+		int64_t value = 0;
+		while (pos < line.size() && isdigit((unsigned char)line[pos])) {
+			value = value * 10 + (line[pos++] - '0');
+			++digits;
+		}
+		if (!digits)
+			return -1;
+		fields[n++] = value;
+		if (pos >= line.size() || line[pos] != ':')
+			break;
+		++pos;
+	}
+	if (n < 2)
+		return -1;
+
+	int64_t ms = 0;
+	if (pos < line.size() && (line[pos] == ',' || line[pos] == '.')) {
+		++pos;
+		int64_t scale = 100;
+		while (pos < line.size() && isdigit((unsigned char)line[pos])) {
+			ms += (line[pos++] - '0') * scale;
+			scale /= 10;
+		}
+	}
+
+	int64_t seconds = n == 3 ?
+		fields[0] * 3600 + fields[1] * 60 + fields[2] :
+		fields[0] * 60 + fields[1];
+	return seconds * 1000 + ms;
+}
+
+// the length of the <i>, <b> or <u> tag (or closing tag) at pos, 0 if
+// there is none
+static size_t keptTag(const std::string& text, size_t pos)
+{
+	size_t name = pos + 1;
+	if (name < text.size() && text[name] == '/')
+		++name;
+	if (name + 1 >= text.size() || text[name + 1] != '>')
+		return 0;
+	char c = tolower((unsigned char)text[name]);
+	return c == 'i' || c == 'b' || c == 'u' ? name + 2 - pos : 0;
+}
+
+// <font> isn't valid WebVTT markup, and --> would end the cue text. any
+// other < would start a tag and & a character reference, so they are
+// escaped, except in the tags WebVTT has too.
+static void cleanText(std::string& text)
+{
+	size_t pos;
+	while ((pos = text.find("<font")) != std::string::npos) {
+		size_t end = text.find('>', pos);
+		text.erase(pos, end == std::string::npos ? std::string::npos : end - pos + 1);
+	}
+	while ((pos = text.find("</font>")) != std::string::npos)
+		text.erase(pos, 7);
+	while ((pos = text.find("-->")) != std::string::npos)
+		text.replace(pos, 3, "->");
+
+	std::string out;
+	out.reserve(text.size());
+	for (pos = 0; pos < text.size(); ++pos)
+	{
+		size_t tag;
+		if (text[pos] == '&')
+			out += "&amp;";
+		else if (text[pos] != '<')
+			out += text[pos];
+		else if ((tag = keptTag(text, pos)) != 0) {
+			// WebVTT tags are lowercase
+			for (size_t i = 0; i < tag; ++i)
+				out += tolower((unsigned char)text[pos + i]);
+			pos += tag - 1;
+		} else
+			out += "&lt;";
+	}
+	text.swap(out);
+}
+
+SubtitleTrack subtitles_parse_srt(const std::string& data)
+{
+	SubtitleTrack track;
+	SubtitleCue cue;
+	bool inCue = false;
+
+	size_t pos = data.compare(0, 3, "\xef\xbb\xbf") == 0 ? 3 : 0;
+	while (pos <= data.size())
+	{
+		size_t eol = data.find_first_of("\r\n", pos);
+		if (eol == std::string::npos)
+			eol = data.size();
+		std::string line = data.substr(pos, eol - pos);
+		pos = eol + 1;
+		if (eol < data.size() && data[eol] == '\r' && pos < data.size() && data[pos] == '\n')
+			++pos;
+
+		if (inCue) {
+			if (!line.empty()) {
+				if (!cue.text.empty())
+					cue.text += '\n';
+				cue.text += line;
+				continue;
+			}
+			cleanText(cue.text);
+			track.push_back(cue);
+			inCue = false;
+			continue;
+		}
+
+		size_t arrow = line.find("-->");
+		if (arrow == std::string::npos)
+			continue;
+		size_t p = 0;
+		cue.start = parseTimestamp(line, p);
+		p = arrow + 3;
+		cue.end = parseTimestamp(line, p);
+		cue.text.clear();
+		inCue = cue.start >= 0 && cue.end >= cue.start;
+	}
+	if (inCue) {
+		cleanText(cue.text);
+		track.push_back(cue);
+	}
+	return track;
+}
+
+static void formatTimestamp(std::string& out, int64_t ms)
+{
+	char buf[32];
+	snprintf(buf, sizeof buf, "%02lld:%02lld:%02lld.%03lld",
+			(long long)(ms / 3600000), (long long)(ms / 60000 % 60),
+			(long long)(ms / 1000 % 60), (long long)(ms % 1000));
+	out += buf;
+}
+
+std::string subtitles_webvtt(const SubtitleTrack& track, int64_t offset)
+{
+	std::string out = "WEBVTT\n\n";
+	for (auto& cue : track)
+	{
+		if (cue.end <= offset)
+			continue;
+		formatTimestamp(out, std::max((int64_t)0, cue.start - offset));
+		out += " --> ";
+		formatTimestamp(out, cue.end - offset);
+		out += '\n';
+		out += cue.text;
+		out += "\n\n";
+	}
+	return out;
+}
+
+SubtitleCache::SubtitleCache(size_t maxTracks)
+: m_max_tracks(maxTracks)
+, m_pid(-1)
+, m_stop(false)
+{
+}
+
+SubtitleCache::~SubtitleCache()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+		if (m_pid != -1)
+			process_kill(m_pid);
+		m_cond.notify_all();
+	}
+	if (m_worker.joinable())
+		m_worker.join();
+}
+
+std::shared_ptr<const SubtitleTrack> SubtitleCache::get(const std::string& path)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0)
+		throw std::runtime_error("subtitles not found");
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto ptr = m_tracks.find(path);
+		if (ptr != m_tracks.end() && ptr->second.mtime == st.st_mtime) {
+			metrics_count("subtitles.cache_hit");
+			return ptr->second.track;
+		}
+	}
+
+	auto begin = std::chrono::steady_clock::now();
+	std::ifstream t(path);
+	std::string data((std::istreambuf_iterator<char>(t)),
+			std::istreambuf_iterator<char>());
+	std::string charset = charset_detect(data);
+	auto detected = std::chrono::steady_clock::now();
+	std::shared_ptr<const SubtitleTrack> track =
+		std::make_shared<const SubtitleTrack>(subtitles_parse_srt(charset_to_utf8(data, charset)));
+	auto end = std::chrono::steady_clock::now();
+	double detect = std::chrono::duration<double>(detected - begin).count();
+	double elapsed = std::chrono::duration<double>(end - begin).count();
+	syslog(LOG_DEBUG, "Parsed %zu cues from %s (%s, detected in %.2fms, %.0f MB/s) in %.2fms",
+			track->size(), path.c_str(), charset.c_str(), detect * 1000,
+			detect > 0 ? data.size() / detect / (1024 * 1024) : 0, elapsed * 1000);
+	metrics_timing("charset.detect", detect);
+	metrics_timing("subtitles.parse", elapsed);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_tracks.size() >= m_max_tracks)
+		m_tracks.clear();
+	Entry entry;
+	entry.mtime = st.st_mtime;
+	entry.charset = charset;
+	entry.track = track;
+	m_tracks[path] = entry;
+	return track;
+}
+
+static std::string streamKey(const std::string& path, unsigned int index)
+{
+	return path + "#" + std::to_string(index);
+}
+
+void SubtitleCache::put(const std::string& key, time_t mtime, const std::shared_ptr<const SubtitleTrack>& track)
+{
+	if (m_tracks.size() >= m_max_tracks)
+		m_tracks.clear();
+	Entry entry;
+	entry.mtime = mtime;
+	entry.charset = "UTF-8";
+	entry.track = track;
+	m_tracks[key] = entry;
+}
+
+void SubtitleCache::extract(const std::string& path, const std::vector<SubtitleStream>& streams)
+{
+	struct stat st;
+	if (streams.empty() || stat(path.c_str(), &st) != 0)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_extracting.count(path))
+		return;
+	bool cached = true;
+	for (auto& stream : streams) {
+		auto ptr = m_tracks.find(streamKey(path, stream.index));
+		if (ptr == m_tracks.end() || ptr->second.mtime != st.st_mtime)
+			cached = false;
+	}
+	if (cached)
+		return;
+
+	m_extracting.insert(path);
+	Extract extract;
+	extract.path = path;
+	extract.mtime = st.st_mtime;
+	extract.streams = streams;
+	m_queue.push_back(extract);
+	if (!m_worker.joinable())
+		m_worker = std::thread(&SubtitleCache::work, this);
+	m_cond.notify_all();
+}
+
+void SubtitleCache::work()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true)
+	{
+		m_cond.wait(lock, [this]() {
+				return m_stop || !m_queue.empty();
+			});
+		if (m_stop)
+			return;
+		Extract extract = m_queue.front();
+		m_queue.pop_front();
+		lock.unlock();
+		run(extract.path, extract.mtime, extract.streams);
+		lock.lock();
+	}
+}
+
+void SubtitleCache::run(const std::string& path, time_t mtime, const std::vector<SubtitleStream>& streams)
+{
+	auto begin = std::chrono::steady_clock::now();
+
+	// one output per stream, so the file is only demuxed once
+	char dir[] = "/tmp/c8tsender.XXXXXX";
+	if (mkdtemp(dir)) {
+		std::vector<std::string> args = { ffmpegpath(), "-y", "-nostdin", "-i", path };
+		for (auto& stream : streams) {
+			args.push_back("-map"); args.push_back("0:s:" + std::to_string(stream.index));
+			args.push_back("-c:s"); args.push_back("srt");
+			args.push_back("-f"); args.push_back("srt");
+			args.push_back(std::string(dir) + "/" + std::to_string(stream.index) + ".srt");
+		}
+		pid_t pid = process_spawn(args);
+		if (pid != -1) {
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_pid = pid;
+				if (m_stop)
+					process_kill(pid);
+			}
+			process_renice(pid, 10);
+			process_wait(pid);
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_pid = -1;
+		}
+
+		for (auto& stream : streams)
+		{
+			std::string file = std::string(dir) + "/" + std::to_string(stream.index) + ".srt";
+			std::ifstream t(file);
+			std::string data((std::istreambuf_iterator<char>(t)),
+					std::istreambuf_iterator<char>());
+			unlink(file.c_str());
+			if (data.empty())
+				continue;
+			std::shared_ptr<const SubtitleTrack> track =
+				std::make_shared<const SubtitleTrack>(subtitles_parse_srt(charset_to_utf8(data, "UTF-8")));
+			std::lock_guard<std::mutex> lock(m_mutex);
+			// a killed ffmpeg leaves the tracks cut short
+			if (!m_stop)
+				put(streamKey(path, stream.index), mtime, track);
+		}
+		rmdir(dir);
+	}
+
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	syslog(LOG_DEBUG, "Extracted %zu subtitle streams from %s in %.1fs", streams.size(), path.c_str(), elapsed);
+	metrics_timing("subtitles.extract", elapsed);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_extracting.erase(path);
+	m_cond.notify_all();
+}
+
+// an extracted stream, waiting up to timeout seconds for the extraction to
+// finish. returns null if it's not available (in time).
+std::shared_ptr<const SubtitleTrack> SubtitleCache::wait(const std::string& path, unsigned int index, unsigned int timeout)
+{
+	std::string key = streamKey(path, index);
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_cond.wait_for(lock, std::chrono::seconds(timeout), [this, &path, &key]() {
+			return m_tracks.count(key) || !m_extracting.count(path);
+		});
+	auto ptr = m_tracks.find(key);
+	if (ptr == m_tracks.end())
+		return std::shared_ptr<const SubtitleTrack>();
+	metrics_count("subtitles.cache_hit");
+	return ptr->second.track;
+}
+
+std::string subtitles_sidecar(const std::string& path)
+{
+	std::string subs = path;
+	if (subs.find_last_of(".") == std::string::npos)
+		return std::string();
+	subs.erase(subs.find_last_of("."), std::string::npos);
+	subs += ".srt";
+	if (access(subs.c_str(), F_OK) != 0)
+		return std::string();
+	return subs;
+}
+
+static bool isTextCodec(const std::string& codec)
+{
+	static const char* codecs[] = { "subrip", "srt", "ass", "ssa", "webvtt", "mov_text", "text", "microdvd", "sami" };
+	for (auto c : codecs)
+		if (codec == c)
+			return true;
+	return false;
+}
+
+std::vector<SubtitleStream> probe_subtitles(const std::string& info)
+{
+	std::vector<SubtitleStream> streams;
+	unsigned int index = 0;
+	bool inSubtitle = false;
+
+	std::string::size_type pos = 0;
+	while (pos < info.size())
+	{
+		std::string::size_type eol = info.find('\n', pos);
+		if (eol == std::string::npos)
+			eol = info.size();
+		std::string line = info.substr(pos, eol - pos);
+		pos = eol + 1;
+
+		// Stream #0:2(eng): Subtitle: subrip (default)
+		if (line.find("Stream #") != std::string::npos) {
+			inSubtitle = false;
+			std::string::size_type type = line.find(": Subtitle: ");
+			if (type == std::string::npos)
+				continue;
+			SubtitleStream stream;
+			stream.index = index++;
+			std::string codec = line.substr(type + 12);
+			stream.codec = codec.substr(0, codec.find_first_of(" ,\r"));
+			std::string::size_type lang = line.find('(');
+			if (lang != std::string::npos && lang < type)
+				stream.language = line.substr(lang + 1, line.find(')', lang) - lang - 1);
+			if (isTextCodec(stream.codec)) {
+				streams.push_back(stream);
+				inSubtitle = true;
+			}
+			continue;
+		}
+
+		//       title           : English (SDH)
+		if (inSubtitle) {
+			std::string::size_type title = line.find("title");
+			std::string::size_type colon = line.find(':');
+			if (title != std::string::npos && colon != std::string::npos && title < colon &&
+					line.find_first_not_of(' ') == title) {
+				std::string value = line.substr(colon + 1);
+				value.erase(0, value.find_first_not_of(' '));
+				value.erase(value.find_last_not_of(" \r") + 1);
+				streams.back().title = value;
+			}
+		}
+	}
+	return streams;
+}
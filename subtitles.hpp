@@ -0,0 +1,82 @@
+#ifndef _SUBTITLES_HPP_
+#define _SUBTITLES_HPP_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+// a subtitle cue, times are in milliseconds
+struct SubtitleCue {
+	int64_t start;
+	int64_t end;
+	std::string text;
+};
+typedef std::vector<SubtitleCue> SubtitleTrack;
+
+// a text subtitle stream in a container, index counts subtitle streams only
+// (as in -map 0:s:index)
+struct SubtitleStream {
+	unsigned int index;
+	std::string language;
+	std::string title;
+	std::string codec;
+};
+
+// the .srt next to path, if there is one
+std::string subtitles_sidecar(const std::string& path);
+// the text subtitle streams from the output of ffmpeg -i
+std::vector<SubtitleStream> probe_subtitles(const std::string& info);
+
+// parse SubRip, data has to be UTF-8
+SubtitleTrack subtitles_parse_srt(const std::string& data);
+// render track as WebVTT, starting offset milliseconds in
+std::string subtitles_webvtt(const SubtitleTrack& track, int64_t offset = 0);
+
+// parsed subtitle files (and their detected charset) by path, a file is
+// read again once it's modified. embedded subtitle streams are extracted
+// all at once, in the background, by a single ffmpeg pass over the file.
+class SubtitleCache {
+	public:
+		SubtitleCache(size_t maxTracks = 32);
+		~SubtitleCache();
+
+		std::shared_ptr<const SubtitleTrack> get(const std::string& path);
+		void extract(const std::string& path, const std::vector<SubtitleStream>& streams);
+		std::shared_ptr<const SubtitleTrack> wait(const std::string& path, unsigned int index, unsigned int timeout);
+	private:
+		void put(const std::string& key, time_t mtime, const std::shared_ptr<const SubtitleTrack>& track);
+		void work();
+		void run(const std::string& path, time_t mtime, const std::vector<SubtitleStream>& streams);
+
+		struct Entry {
+			time_t mtime;
+			std::string charset;
+			std::shared_ptr<const SubtitleTrack> track;
+		};
+		struct Extract {
+			std::string path;
+			time_t mtime;
+			std::vector<SubtitleStream> streams;
+		};
+		size_t m_max_tracks;
+		std::map<std::string, Entry> m_tracks;
+		std::set<std::string> m_extracting;
+		// the files are extracted one at a time by m_worker, which is
+		// joined (after killing the ffmpeg in m_pid) on destruction
+		std::deque<Extract> m_queue;
+		std::thread m_worker;
+		pid_t m_pid;
+		bool m_stop;
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+};
+
+#endif
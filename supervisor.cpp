@@ -0,0 +1,522 @@
+#include "supervisor.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <syslog.h>
+
+StreamJob::StreamJob(Transcoder* transcoder, size_t budget, size_t capacity)
+: m_transcoder(transcoder)
+, m_ring(std::max(budget, capacity))
+, m_budget(budget)
+, m_start(0)
+, m_end(0)
+, m_eof(false)
+, m_error(false)
+, m_stop(false)
+, m_watchdog(true)
+, m_reading(false)
+, m_stalled(false)
+, m_consumer_id(0)
+{
+	m_pump = std::thread(&StreamJob::pump, this);
+}
+
+StreamJob::~StreamJob()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+		m_cond.notify_all();
+	}
+	m_transcoder->interrupt();
+	m_pump.join();
+}
+
+// the offset of the slowest consumer, before anyone attached we read ahead
+// from the beginning (so a job can be started ahead of time)
+uint64_t StreamJob::getConsumed() const
+{
+	uint64_t consumed = m_consumers.empty() ? 0 : m_end;
+	for (auto& consumer : m_consumers)
+		consumed = std::min(consumed, consumer.second);
+	return consumed;
+}
+
+void StreamJob::pump()
+{
+	const size_t block = std::min((size_t)256 * 1024, m_ring.size());
+	std::vector<char> buf(block);
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cond.wait(lock, [this, block]() {
+					uint64_t consumed = getConsumed();
+					return m_stop || (m_end - consumed < m_budget &&
+						m_end + block - consumed <= m_ring.size());
+				});
+			if (m_stop)
+				return;
+			m_reading = true;
+			m_reading_since = std::chrono::steady_clock::now();
+		}
+
+		ssize_t r = m_transcoder->read(&buf[0], block);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_reading = false;
+		if (r <= 0) {
+			m_eof = true;
+			m_error = r < 0 || m_stalled;
+			m_cond.notify_all();
+			return;
+		}
+		size_t pos = m_end % m_ring.size();
+		size_t first = std::min((size_t)r, m_ring.size() - pos);
+		memcpy(&m_ring[pos], &buf[0], first);
+		memcpy(&m_ring[0], &buf[first], r - first);
+		m_end += r;
+		if (m_end > m_ring.size())
+			m_start = std::max(m_start, m_end - m_ring.size());
+		m_cond.notify_all();
+	}
+}
+
+unsigned int StreamJob::attach()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	unsigned int id = m_consumer_id++;
+	m_consumers[id] = 0;
+	return id;
+}
+
+void StreamJob::detach(unsigned int consumer)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_consumers.erase(consumer);
+	m_cond.notify_all();
+}
+
+ssize_t StreamJob::read(unsigned int consumer, char* buf, size_t max)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	uint64_t& offset = m_consumers[consumer];
+	m_cond.wait(lock, [this, &offset]() {
+			return m_stop || m_eof || offset < m_end;
+		});
+
+	// overwritten before this consumer attached
+	if (offset < m_start)
+		return -1;
+
+	if (offset < m_end) {
+		size_t len = std::min((uint64_t)max, m_end - offset);
+		size_t pos = offset % m_ring.size();
+		size_t first = std::min(len, m_ring.size() - pos);
+		memcpy(buf, &m_ring[pos], first);
+		memcpy(buf + first, &m_ring[0], len - first);
+		offset += len;
+		m_cond.notify_all();
+		return len;
+	}
+	return m_error || m_stop ? -1 : 0;
+}
+
+bool StreamJob::isJoinable()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_start == 0 && !m_error;
+}
+
+// a prefetched job that got a consumer, continue at normal priority and
+// read-ahead
+void StreamJob::promote(size_t budget)
+{
+	m_transcoder->setPriority(0);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_budget = std::min(budget, m_ring.size());
+	m_cond.notify_all();
+}
+
+const char* StreamJob::getName() const
+{
+	return m_transcoder->getName();
+}
+
+double StreamJob::getBitrate() const
+{
+	return m_transcoder->getBitrate();
+}
+
+bool StreamJob::getProgress(TranscodeProgress& progress) const
+{
+	return m_transcoder->getProgress(progress);
+}
+
+void StreamJob::setWatchdog(bool value)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_watchdog = value;
+}
+
+// how long the transcoder has kept us waiting for output, the time spent
+// waiting for consumers to catch up doesn't count
+double StreamJob::getStalled() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_watchdog || !m_reading || m_stalled)
+		return 0;
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_reading_since).count();
+}
+
+// end the job (with an error) instead of waiting any longer
+void StreamJob::stall()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stalled = true;
+	}
+	m_transcoder->interrupt();
+}
+
+StreamConsumer::StreamConsumer(const std::shared_ptr<StreamJob>& job)
+: m_job(job)
+, m_id(job->attach())
+{
+}
+
+StreamConsumer::~StreamConsumer()
+{
+	m_job->detach(m_id);
+}
+
+ssize_t StreamConsumer::read(char* buf, size_t max)
+{
+	return m_job->read(m_id, buf, max);
+}
+
+void StreamConsumer::interrupt()
+{
+}
+
+const char* StreamConsumer::getName() const
+{
+	return m_job->getName();
+}
+
+Supervisor::Supervisor(unsigned int maxJobs, size_t bufferSize)
+: m_max_jobs(maxJobs)
+, m_jobs(0)
+, m_buffer_size(bufferSize)
+, m_read_ahead(bufferSize)
+, m_read_ahead_seconds(0)
+, m_stall_timeout(0)
+, m_stop(false)
+{
+}
+
+Supervisor::~Supervisor()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+		m_cond.notify_all();
+	}
+	if (m_watchdog.joinable())
+		m_watchdog.join();
+
+	// the deleter of the prefetched job releases it, which needs m_mutex
+	// and m_cond (destroyed before m_prefetch otherwise)
+	std::shared_ptr<StreamJob> prefetched;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		prefetched.swap(m_prefetch);
+	}
+	prefetched.reset();
+}
+
+std::shared_ptr<StreamJob> Supervisor::acquire(const std::string& key, std::function<Transcoder*()> factory)
+{
+	// may hold the last reference to a job, so it must go after the lock
+	// has been released (the job's deleter takes the lock)
+	std::shared_ptr<StreamJob> running, prefetched, unused;
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	auto ptr = m_running.find(key);
+	if (ptr != m_running.end()) {
+		running = ptr->second.lock();
+		if (running && running->isJoinable()) {
+			if (running == m_prefetch) {
+				syslog(LOG_DEBUG, "Using prefetched job %s", key.c_str());
+				metrics_count("supervisor.prefetch_hit");
+				running->promote(getBudget(running->getBitrate()));
+				prefetched.swap(m_prefetch);
+				m_prefetch_key.clear();
+				return running;
+			}
+			syslog(LOG_DEBUG, "Joining running job %s", key.c_str());
+			metrics_count("supervisor.joined");
+			return running;
+		}
+		m_running.erase(ptr);
+	}
+
+	// a prefetched job never stands in the way of a request
+	if (m_jobs >= m_max_jobs && m_prefetch) {
+		syslog(LOG_DEBUG, "Dropping prefetched job %s", m_prefetch_key.c_str());
+		metrics_count("supervisor.prefetch_dropped");
+		prefetched.swap(m_prefetch);
+		m_prefetch_key.clear();
+		lock.unlock();
+		prefetched.reset();
+		lock.lock();
+	}
+
+	// give closing connections a moment to release their job
+	if (!m_cond.wait_for(lock, std::chrono::seconds(5), [this]() { return m_jobs < m_max_jobs; })) {
+		syslog(LOG_ERR, "Too many jobs running, rejecting %s", key.c_str());
+		metrics_count("supervisor.rejected");
+		return std::shared_ptr<StreamJob>();
+	}
+
+	// the slot is taken while the transcoder is made (which probes and
+	// spawns), that is done without the lock
+	m_jobs++;
+	unsigned int stallTimeout = m_stall_timeout;
+	lock.unlock();
+	Transcoder* transcoder;
+	try {
+		transcoder = factory();
+	} catch (...) {
+		release();
+		throw;
+	}
+	bool recovers = stallTimeout && transcoder->setStallTimeout(stallTimeout);
+
+	lock.lock();
+	std::shared_ptr<StreamJob> job(new StreamJob(transcoder, getBudget(transcoder->getBitrate()), m_buffer_size),
+		[this](StreamJob* job) {
+			delete job;
+			release();
+		});
+	job->setWatchdog(!recovers);
+	metrics_gauge("supervisor.jobs", m_jobs);
+
+	// another request for key may have started it in the meantime
+	ptr = m_running.find(key);
+	if (ptr != m_running.end()) {
+		running = ptr->second.lock();
+		if (running && running->isJoinable()) {
+			syslog(LOG_DEBUG, "Joining running job %s", key.c_str());
+			metrics_count("supervisor.joined");
+			if (running == m_prefetch) {
+				running->promote(getBudget(running->getBitrate()));
+				prefetched.swap(m_prefetch);
+				m_prefetch_key.clear();
+			}
+			unused.swap(job);
+			return running;
+		}
+	}
+	m_running[key] = job;
+
+	for (auto i = m_running.begin(); i != m_running.end();) {
+		if (i->second.expired())
+			i = m_running.erase(i);
+		else
+			++i;
+	}
+	return job;
+}
+
+// start the job for key without a consumer, reading at most seconds of
+// output ahead. the previous prefetched job (if any) is dropped, and nothing
+// is started if the key is already running or all slots are taken.
+void Supervisor::prefetch(const std::string& key, std::function<Transcoder*()> factory, unsigned int seconds)
+{
+	std::shared_ptr<StreamJob> previous;
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	auto ptr = m_running.find(key);
+	if (ptr != m_running.end() && !ptr->second.expired())
+		return;
+
+	if (m_prefetch) {
+		previous.swap(m_prefetch);
+		m_prefetch_key.clear();
+		lock.unlock();
+		previous.reset();
+		lock.lock();
+	}
+
+	if (m_jobs >= m_max_jobs) {
+		syslog(LOG_DEBUG, "No free slot to prefetch %s", key.c_str());
+		return;
+	}
+
+	// the slot is taken while probing, which is done without the lock
+	m_jobs++;
+	size_t readAhead = m_read_ahead;
+	unsigned int stallTimeout = m_stall_timeout;
+	lock.unlock();
+	Transcoder* transcoder;
+	try {
+		transcoder = factory();
+	} catch (std::exception& e) {
+		syslog(LOG_ERR, "Prefetch of %s failed: %s", key.c_str(), e.what());
+		release();
+		return;
+	} catch (...) {
+		syslog(LOG_ERR, "Prefetch of %s failed", key.c_str());
+		release();
+		return;
+	}
+	transcoder->setPriority(10);
+
+	size_t budget = seconds * transcoder->getBitrate() / 8;
+	if (!budget)
+		budget = readAhead;
+	bool recovers = stallTimeout && transcoder->setStallTimeout(stallTimeout);
+	std::shared_ptr<StreamJob> job(new StreamJob(transcoder, budget, m_buffer_size), [this](StreamJob* job) {
+			delete job;
+			release();
+		});
+	job->setWatchdog(!recovers);
+
+	lock.lock();
+	metrics_gauge("supervisor.jobs", m_jobs);
+	metrics_count("supervisor.prefetched");
+	syslog(LOG_DEBUG, "Prefetching %s", key.c_str());
+	m_running[key] = job;
+	previous = m_prefetch;
+	m_prefetch = job;
+	m_prefetch_key = key;
+	lock.unlock();
+}
+
+// take a slot for a stream that is not run as a job (spliced to the
+// client), without waiting. it is given back with release()
+bool Supervisor::reserve(const std::string& key)
+{
+	std::shared_ptr<StreamJob> prefetched;
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	if (m_jobs >= m_max_jobs && m_prefetch) {
+		syslog(LOG_DEBUG, "Dropping prefetched job %s", m_prefetch_key.c_str());
+		metrics_count("supervisor.prefetch_dropped");
+		prefetched.swap(m_prefetch);
+		m_prefetch_key.clear();
+		lock.unlock();
+		prefetched.reset();
+		lock.lock();
+	}
+
+	if (m_jobs >= m_max_jobs) {
+		syslog(LOG_DEBUG, "No free slot for %s", key.c_str());
+		return false;
+	}
+	m_jobs++;
+	metrics_gauge("supervisor.jobs", m_jobs);
+	return true;
+}
+
+// the read-ahead budget in seconds is converted using the source bitrate
+size_t Supervisor::getBudget(double bitrate) const
+{
+	return std::max(m_read_ahead, (size_t)(m_read_ahead_seconds * bitrate / 8));
+}
+
+void Supervisor::release()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_jobs--;
+	metrics_gauge("supervisor.jobs", m_jobs);
+	m_cond.notify_all();
+}
+
+void Supervisor::setMaxJobs(unsigned int maxJobs)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_max_jobs = std::max(1u, maxJobs);
+	m_cond.notify_all();
+}
+
+void Supervisor::setReadAhead(size_t bytes, unsigned int seconds)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_read_ahead = std::max((size_t)1, bytes);
+	m_read_ahead_seconds = seconds;
+}
+
+void Supervisor::setStallTimeout(unsigned int seconds, StallCallback callback)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stall_timeout = seconds;
+	m_stall_callback = callback;
+	if (m_stall_timeout && !m_watchdog.joinable())
+		m_watchdog = std::thread(&Supervisor::watchdog, this);
+}
+
+void Supervisor::watchdog()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_cond.wait_for(lock, std::chrono::seconds(1), [this]() { return m_stop; }))
+	{
+		// the jobs may be the last references, they go after the lock
+		std::map<std::string, std::shared_ptr<StreamJob>> jobs;
+		for (auto& item : m_running)
+		{
+			std::shared_ptr<StreamJob> job = item.second.lock();
+			if (job)
+				jobs[item.first] = job;
+		}
+		double timeout = m_stall_timeout;
+		StallCallback callback = m_stall_callback;
+		lock.unlock();
+
+		for (auto& item : jobs)
+		{
+			double stalled = item.second->getStalled();
+			if (!timeout || stalled < timeout)
+				continue;
+			syslog(LOG_WARNING, "Job %s produced nothing for %.1fs, stopping it", item.first.c_str(), stalled);
+			metrics_count("supervisor.stalled");
+			item.second->stall();
+			if (callback)
+				callback(item.first, stalled);
+		}
+		jobs.clear();
+		lock.lock();
+	}
+}
+
+unsigned int Supervisor::getJobs() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_jobs;
+}
+
+std::map<std::string, TranscodeProgress> Supervisor::getProgress() const
+{
+	// the jobs may be the last references, they go after the lock
+	std::map<std::string, std::shared_ptr<StreamJob>> jobs;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto& item : m_running)
+		{
+			std::shared_ptr<StreamJob> job = item.second.lock();
+			if (job)
+				jobs[item.first] = job;
+		}
+	}
+	std::map<std::string, TranscodeProgress> result;
+	for (auto& item : jobs)
+	{
+		TranscodeProgress progress;
+		if (item.second->getProgress(progress))
+			result[item.first] = progress;
+	}
+	return result;
+}
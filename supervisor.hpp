@@ -0,0 +1,114 @@
+#ifndef _SUPERVISOR_HPP_
+#define _SUPERVISOR_HPP_
+
+#include "transcoder.hpp"
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+// a running transcode whose output is shared by one or more consumers
+// through a ring buffer. a pump thread keeps reading from the transcoder as
+// long as the slowest consumer is less than the read-ahead budget behind.
+class StreamJob {
+	public:
+		StreamJob(Transcoder* transcoder, size_t budget, size_t capacity);
+		~StreamJob();
+
+		unsigned int attach();
+		void detach(unsigned int consumer);
+		ssize_t read(unsigned int consumer, char* buf, size_t max);
+		bool isJoinable();
+		void promote(size_t budget);
+		const char* getName() const;
+		double getBitrate() const;
+		bool getProgress(TranscodeProgress& progress) const;
+		void setWatchdog(bool value);
+		double getStalled() const;
+		void stall();
+	private:
+		void pump();
+		uint64_t getConsumed() const;
+
+		std::unique_ptr<Transcoder> m_transcoder;
+		std::vector<char> m_ring;
+		size_t m_budget;
+		uint64_t m_start;
+		uint64_t m_end;
+		bool m_eof;
+		bool m_error;
+		bool m_stop;
+		bool m_watchdog;
+		bool m_reading;
+		bool m_stalled;
+		std::chrono::steady_clock::time_point m_reading_since;
+		unsigned int m_consumer_id;
+		std::map<unsigned int, uint64_t> m_consumers;
+		mutable std::mutex m_mutex;
+		std::condition_variable m_cond;
+		std::thread m_pump;
+};
+
+// reads a StreamJob from the beginning
+class StreamConsumer : public Transcoder {
+	public:
+		StreamConsumer(const std::shared_ptr<StreamJob>& job);
+		~StreamConsumer();
+
+		ssize_t read(char* buf, size_t max);
+		void interrupt();
+		const char* getName() const;
+	private:
+		std::shared_ptr<StreamJob> m_job;
+		unsigned int m_id;
+};
+
+// keeps track of running jobs by key (uuid, seek and plan), a request for a
+// key that is already running is attached to the same job (as long as it
+// has not overwritten its beginning), and limits the number of jobs.
+// one job may be prefetched (at low priority, without consumers) for the
+// track expected to play next, it gives up its slot to any other request.
+// a watchdog stops jobs whose transcoder produced nothing for the stall
+// timeout (unless the transcoder recovers by itself) and reports them.
+class Supervisor {
+	public:
+		typedef std::function<void(const std::string& key, double stalled)> StallCallback;
+
+		Supervisor(unsigned int maxJobs = 2, size_t bufferSize = 16 * 1024 * 1024);
+		~Supervisor();
+
+		std::shared_ptr<StreamJob> acquire(const std::string& key, std::function<Transcoder*()> factory);
+		void prefetch(const std::string& key, std::function<Transcoder*()> factory, unsigned int seconds);
+		bool reserve(const std::string& key);
+		void release();
+
+		void setMaxJobs(unsigned int maxJobs);
+		void setReadAhead(size_t bytes, unsigned int seconds);
+		void setStallTimeout(unsigned int seconds, StallCallback callback);
+		unsigned int getJobs() const;
+		std::map<std::string, TranscodeProgress> getProgress() const;
+	private:
+		size_t getBudget(double bitrate) const;
+		void watchdog();
+
+		unsigned int m_max_jobs;
+		unsigned int m_jobs;
+		size_t m_buffer_size;
+		size_t m_read_ahead;
+		unsigned int m_read_ahead_seconds;
+		std::map<std::string, std::weak_ptr<StreamJob>> m_running;
+		std::shared_ptr<StreamJob> m_prefetch;
+		std::string m_prefetch_key;
+		unsigned int m_stall_timeout;
+		StallCallback m_stall_callback;
+		bool m_stop;
+		std::thread m_watchdog;
+		mutable std::mutex m_mutex;
+		std::condition_variable m_cond;
+};
+
+#endif
@@ -0,0 +1,127 @@
+#include "trackid.hpp"
+#include <random>
+#include <mutex>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+TrackId TrackId::generate()
+{
+	static std::mutex mutex;
+	static std::mt19937_64 engine = []() {
+		std::random_device rd;
+		std::seed_seq seed { rd(), rd(), rd(), rd() };
+		return std::mt19937_64(seed);
+	}();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	return generate(engine);
+}
+
+TrackId TrackId::generate(std::mt19937_64& engine)
+{
+	TrackId id;
+	id.hi = engine();
+	id.lo = engine();
+	// version 4, variant 1
+	id.hi = (id.hi & ~0xf000ULL) | 0x4000ULL;
+	id.lo = (id.lo & ~(3ULL << 62)) | (2ULL << 62);
+	return id;
+}
+
+std::string TrackId::str() const
+{
+	char buf[37];
+	snprintf(buf, sizeof buf, "%08x-%04x-%04x-%04x-%012llx",
+			(unsigned int)(hi >> 32), (unsigned int)(hi >> 16) & 0xffff, (unsigned int)hi & 0xffff,
+			(unsigned int)(lo >> 48), (unsigned long long)lo & 0xffffffffffffULL);
+	return buf;
+}
+
+#if defined(__SSE2__)
+// 16 hex digits (either case) to their values in 16 bytes
+static bool nibblesSSE2(__m128i c, __m128i& v)
+{
+	__m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+			_mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+	__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+			_mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+	if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xffff)
+		return false;
+	v = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+			_mm_and_si128(alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+	return true;
+}
+
+// each pair of nibbles (in a 16-bit lane, first digit in the low byte) to
+// a byte, then 32 digits are packed into 16 bytes
+static bool hexSSE2(const char* in, unsigned char* out)
+{
+	__m128i a, b;
+	if (!nibblesSSE2(_mm_loadu_si128((const __m128i*)in), a) ||
+			!nibblesSSE2(_mm_loadu_si128((const __m128i*)(in + 16)), b))
+		return false;
+	__m128i mask = _mm_set1_epi16(0x00ff);
+	a = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, mask), 4), _mm_srli_epi16(a, 8));
+	b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, mask), 4), _mm_srli_epi16(b, 8));
+	_mm_storeu_si128((__m128i*)out, _mm_packus_epi16(a, b));
+	return true;
+}
+#else
+static int nibble(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+static bool hexScalar(const char* in, unsigned char* out)
+{
+	for (size_t i = 0; i < 16; ++i) {
+		int h = nibble(in[i * 2]), l = nibble(in[i * 2 + 1]);
+		if (h < 0 || l < 0)
+			return false;
+		out[i] = h << 4 | l;
+	}
+	return true;
+}
+#endif
+
+TrackId TrackId::parse(const std::string& text)
+{
+	TrackId id;
+	if (text.empty())
+		return id;
+
+	// 8-4-4-4-12
+	const char* p = text.c_str();
+	if (text.size() != 36 || p[8] != '-' || p[13] != '-' || p[18] != '-' || p[23] != '-')
+		throw std::runtime_error("invalid track id");
+	char hex[32];
+	memcpy(hex, p, 8);
+	memcpy(hex + 8, p + 9, 4);
+	memcpy(hex + 12, p + 14, 4);
+	memcpy(hex + 16, p + 19, 4);
+	memcpy(hex + 20, p + 24, 12);
+
+	unsigned char bytes[16];
+#if defined(__SSE2__)
+	bool valid = hexSSE2(hex, bytes);
+#else
+	bool valid = hexScalar(hex, bytes);
+#endif
+	if (!valid)
+		throw std::runtime_error("invalid track id");
+	for (int i = 0; i < 8; ++i) {
+		id.hi = id.hi << 8 | bytes[i];
+		id.lo = id.lo << 8 | bytes[i + 8];
+	}
+	return id;
+}
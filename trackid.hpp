@@ -0,0 +1,38 @@
+#ifndef _TRACKID_HPP_
+#define _TRACKID_HPP_
+
+#include <stdint.h>
+#include <string>
+#include <functional>
+#include <random>
+
+// a random (version 4) uuid kept as 16 bytes, it's only formatted as text
+// for the REST API and the receiver. the nil id means no track.
+struct TrackId {
+	TrackId() : hi(0), lo(0) {}
+
+	static TrackId generate();
+	// from a caller's own engine, without the lock around the shared one
+	static TrackId generate(std::mt19937_64& engine);
+	// throws std::runtime_error on anything but a uuid, "" is the nil id
+	static TrackId parse(const std::string& text);
+	std::string str() const;
+
+	bool empty() const { return !hi && !lo; }
+	bool operator==(const TrackId& other) const { return hi == other.hi && lo == other.lo; }
+	bool operator!=(const TrackId& other) const { return !(*this == other); }
+
+	uint64_t hi;
+	uint64_t lo;
+};
+
+namespace std {
+	template<> struct hash<TrackId> {
+		size_t operator()(const TrackId& id) const {
+			// the bits are random already
+			return (size_t)(id.hi ^ id.lo);
+		}
+	};
+}
+
+#endif
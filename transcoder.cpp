@@ -0,0 +1,498 @@
+#include "transcoder.hpp"
+#include "process.hpp"
+#include "metrics.hpp"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <syslog.h>
+#include <map>
+
+extern const char* ffmpegpath();
+
+// probing is slow (it starts ffmpeg), the results are kept so that a track
+// probed ahead of time starts right away
+static std::map<std::string, std::string> g_probes;
+static std::mutex g_probes_mutex;
+
+std::string probe(const std::string& path)
+{
+	{
+		std::lock_guard<std::mutex> lock(g_probes_mutex);
+		auto ptr = g_probes.find(path);
+		if (ptr != g_probes.end())
+			return ptr->second;
+	}
+	std::string info = process_run({ffmpegpath(), "-i", path}, false);
+	std::lock_guard<std::mutex> lock(g_probes_mutex);
+	if (g_probes.size() >= 256)
+		g_probes.clear();
+	g_probes[path] = info;
+	return info;
+}
+
+// h264 is remuxed as is, anything else is transcoded
+std::string probe_vcodec(const std::string& info)
+{
+	if (info.find("Video: h264") != std::string::npos)
+		return "copy";
+	return "h264";
+}
+
+double probe_duration(const std::string& info)
+{
+	std::string::size_type pos = info.find("Duration: ");
+	if (pos == std::string::npos)
+		return 0;
+	unsigned int h, m;
+	double s;
+	if (sscanf(info.c_str() + pos + 10, "%u:%u:%lf", &h, &m, &s) != 3)
+		return 0;
+	return h * 3600 + m * 60 + s;
+}
+
+double probe_start(const std::string& info)
+{
+	std::string::size_type pos = info.find(", start: ");
+	if (pos == std::string::npos)
+		return 0;
+	return strtod(info.c_str() + pos + 9, NULL);
+}
+
+double probe_bitrate(const std::string& info)
+{
+	std::string::size_type pos = info.find("bitrate: ");
+	if (pos == std::string::npos)
+		return 0;
+	return strtod(info.c_str() + pos + 9, NULL) * 1000;
+}
+
+// let ffmpeg run further ahead of us than the default 64 KB pipe buffer
+static void enlarge_pipe(int fd)
+{
+#ifdef F_SETPIPE_SZ
+	fcntl(fd, F_SETPIPE_SZ, 1024 * 1024);
+#endif
+}
+
+// a transcode slower than realtime for this long is reported
+static const double slow_after = 10;
+
+ProgressReader::ProgressReader(int fd, const std::string& name)
+: m_fd(fd)
+, m_name(name)
+, m_below(false)
+{
+	m_thread = std::thread(&ProgressReader::run, this);
+}
+
+ProgressReader::~ProgressReader()
+{
+	m_thread.join();
+	close(m_fd);
+}
+
+TranscodeProgress ProgressReader::get() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_progress;
+}
+
+void ProgressReader::run()
+{
+	// a block of key=value lines ends with progress=continue (or end),
+	// values ffmpeg doesn't know yet are N/A
+	TranscodeProgress progress;
+	std::string buf;
+	char data[4096];
+	ssize_t r;
+	while ((r = ::read(m_fd, data, sizeof data)) > 0)
+	{
+		buf.append(data, r);
+		std::string::size_type start = 0, eol;
+		while ((eol = buf.find('\n', start)) != std::string::npos)
+		{
+			std::string line = buf.substr(start, eol - start);
+			start = eol + 1;
+			std::string::size_type eq = line.find('=');
+			if (eq == std::string::npos)
+				continue;
+			std::string key = line.substr(0, eq);
+			const char* value = line.c_str() + eq + 1;
+			if (key == "fps")
+				progress.fps = strtod(value, NULL);
+			else if (key == "speed")
+				progress.speed = strtod(value, NULL);
+			else if (key == "bitrate")
+				progress.bitrate = strtod(value, NULL) * 1000;
+			else if (key == "total_size")
+				progress.bytes = strtoull(value, NULL, 10);
+			else if (key == "out_time_us")
+				progress.time = strtoll(value, NULL, 10) / 1000000.0;
+			else if (key == "progress")
+				update(progress);
+		}
+		buf.erase(0, start);
+	}
+}
+
+void ProgressReader::update(const TranscodeProgress& progress)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	bool slow = m_progress.slow;
+	m_progress = progress;
+	m_progress.slow = slow;
+
+	// the first blocks report no speed, only count a speed below realtime
+	if (progress.speed <= 0 || progress.speed >= 1.0) {
+		m_below = false;
+		m_progress.slow = false;
+		return;
+	}
+	auto now = std::chrono::steady_clock::now();
+	if (!m_below) {
+		m_below = true;
+		m_below_since = now;
+	}
+	if (!slow && std::chrono::duration<double>(now - m_below_since).count() >= slow_after) {
+		m_progress.slow = true;
+		syslog(LOG_WARNING, "Transcode of %s is slower than realtime (%.2fx, %.1f fps)",
+				m_name.c_str(), progress.speed, progress.fps);
+		metrics_count("transcode.slow");
+	}
+}
+
+ProcessTranscoder::ProcessTranscoder(const std::vector<std::string>& args, double bitrate, bool progress)
+: m_bitrate(bitrate)
+{
+	if (!progress) {
+		m_pid = process_spawn(args, NULL, &m_fd);
+		enlarge_pipe(m_fd);
+		return;
+	}
+
+	std::vector<std::string> a(args);
+	a.insert(a.begin() + 1, { "-progress", "pipe:3", "-nostats" });
+	std::string name = "stream";
+	auto input = std::find(args.begin(), args.end(), "-i");
+	if (input != args.end() && input + 1 != args.end())
+		name = *(input + 1);
+	int fd;
+	m_pid = process_spawn(a, NULL, &m_fd, NULL, &fd);
+	enlarge_pipe(m_fd);
+	m_progress.reset(new ProgressReader(fd, name));
+}
+
+ProcessTranscoder::~ProcessTranscoder()
+{
+	process_kill(m_pid);
+	process_wait(m_pid);
+	close(m_fd);
+	// the progress pipe is at EOF once the process is gone
+	m_progress.reset();
+}
+
+ssize_t ProcessTranscoder::read(char* buf, size_t max)
+{
+	return ::read(m_fd, buf, max);
+}
+
+void ProcessTranscoder::interrupt()
+{
+	process_kill(m_pid);
+}
+
+const char* ProcessTranscoder::getName() const
+{
+	return "process";
+}
+
+double ProcessTranscoder::getBitrate() const
+{
+	return m_bitrate;
+}
+
+void ProcessTranscoder::setPriority(int nice)
+{
+	process_renice(m_pid, nice);
+}
+
+bool ProcessTranscoder::getProgress(TranscodeProgress& progress) const
+{
+	if (!m_progress)
+		return false;
+	progress = m_progress->get();
+	return true;
+}
+
+int ProcessTranscoder::getFd() const
+{
+	return m_fd;
+}
+
+ChunkedTranscoder::ChunkedTranscoder(const std::string& path, double startTime, double duration,
+		unsigned int workers, unsigned int chunkSize, double bitrate,
+		std::shared_ptr<const Keyframes> keyframes)
+: m_path(path)
+, m_bitrate(bitrate)
+, m_next(0)
+, m_current(0)
+, m_lookahead(workers * 2)
+, m_bytes(0)
+, m_nice(0)
+, m_stall_timeout(0)
+, m_stop(false)
+, m_failed(false)
+, m_started(std::chrono::steady_clock::now())
+{
+	// with a keyframe index, chunks are split at the first keyframe after
+	// each chunkSize (within half a chunk), so no chunk starts with frames
+	// which depend on the previous one
+	for (double t = startTime; t < duration;) {
+		double end = t + chunkSize;
+		if (keyframes) {
+			auto ptr = std::lower_bound(keyframes->begin(), keyframes->end(), end,
+					[](const Keyframe& keyframe, double t) {
+						return keyframe.time < t;
+					});
+			if (ptr != keyframes->end() && ptr->time < end + chunkSize / 2.0)
+				end = ptr->time;
+		}
+		Chunk chunk;
+		chunk.start = t;
+		chunk.length = std::min(end, duration) - t;
+		chunk.done = false;
+		chunk.failed = false;
+		chunk.pid = -1;
+		m_chunks.push_back(chunk);
+		t = end;
+	}
+
+	// share the cores between the workers
+	unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+	m_threads = std::max(1u, cores / workers);
+
+	// the chunks are mpegts (which can be concatenated), remux them into
+	// a single matroska stream
+	m_pid = process_spawn({ ffmpegpath(), "-y", "-f", "mpegts", "-i", "-",
+			"-vcodec", "copy", "-acodec", "copy", "-f", "matroska", "-" }, &m_in, &m_out);
+	enlarge_pipe(m_out);
+
+	for (unsigned int i = 0; i < workers; ++i)
+		m_workers.push_back(std::thread(&ChunkedTranscoder::work, this));
+	m_feeder = std::thread(&ChunkedTranscoder::feed, this);
+}
+
+ChunkedTranscoder::~ChunkedTranscoder()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+		for (auto& chunk : m_chunks)
+			if (chunk.pid != -1)
+				process_kill(chunk.pid);
+		m_cond.notify_all();
+	}
+	process_kill(m_pid);
+	for (auto& worker : m_workers)
+		worker.join();
+	m_feeder.join();
+	process_wait(m_pid);
+	close(m_out);
+
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_started).count();
+	double encoded = 0;
+	for (size_t i = 0; i < m_current; ++i)
+		encoded += m_chunks[i].length;
+	syslog(LOG_DEBUG, "Chunked transcode of %s: %.1fs in %.1fs (%.2fx realtime)",
+			m_path.c_str(), encoded, elapsed, elapsed > 0 ? encoded / elapsed : 0);
+}
+
+// the chunks after one that failed are never fed, so the output just ends
+// there, that end is an error instead
+ssize_t ChunkedTranscoder::read(char* buf, size_t max)
+{
+	ssize_t r = ::read(m_out, buf, max);
+	if (r == 0) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_failed) {
+			errno = EIO;
+			return -1;
+		}
+	}
+	return r;
+}
+
+void ChunkedTranscoder::interrupt()
+{
+	process_kill(m_pid);
+}
+
+const char* ChunkedTranscoder::getName() const
+{
+	return "chunked";
+}
+
+double ChunkedTranscoder::getBitrate() const
+{
+	return m_bitrate;
+}
+
+void ChunkedTranscoder::setPriority(int nice)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_nice = nice;
+	for (auto& chunk : m_chunks)
+		if (chunk.pid != -1)
+			process_renice(chunk.pid, nice);
+	process_renice(m_pid, nice);
+}
+
+// the chunk processes run ahead in parallel, so the speed is that of the
+// whole transcoder: the seconds finished so far over the time it took
+bool ChunkedTranscoder::getProgress(TranscodeProgress& progress) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_started).count();
+	progress = TranscodeProgress();
+	for (size_t i = 0; i < m_current; ++i)
+		progress.time += m_chunks[i].length;
+	progress.bytes = m_bytes;
+	progress.speed = elapsed > 0 ? progress.time / elapsed : 0;
+	progress.bitrate = progress.time > 0 ? m_bytes * 8 / progress.time : 0;
+	progress.slow = elapsed >= slow_after && progress.speed < 1.0 && m_current < m_chunks.size();
+	return true;
+}
+
+// a chunk is only passed on once it's complete, so a stalled chunk process
+// can be restarted without the output noticing
+bool ChunkedTranscoder::setStallTimeout(unsigned int seconds)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stall_timeout = seconds;
+	return true;
+}
+
+void ChunkedTranscoder::work()
+{
+	while (true)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cond.wait(lock, [this]() {
+				return m_stop || m_next >= m_chunks.size() || m_next < m_current + m_lookahead;
+			});
+		if (m_stop || m_next >= m_chunks.size())
+			return;
+		size_t i = m_next++;
+		std::string start = std::to_string(m_chunks[i].start);
+		std::string length = std::to_string(m_chunks[i].length);
+		std::string threads = std::to_string(m_threads);
+		auto begin = std::chrono::steady_clock::now();
+		std::string data;
+		for (unsigned int attempt = 0; ; ++attempt)
+		{
+			int fd;
+			m_chunks[i].pid = process_spawn({ ffmpegpath(), "-y",
+					"-ss", start, "-i", m_path, "-t", length,
+					"-vcodec", "h264", "-acodec", "aac", "-strict", "-2",
+					"-threads", threads,
+					"-output_ts_offset", start,
+					"-f", "mpegts", "-" }, NULL, &fd);
+			if (m_nice)
+				process_renice(m_chunks[i].pid, m_nice);
+			unsigned int timeout = m_stall_timeout;
+			lock.unlock();
+
+			data.clear();
+			bool stalled = false;
+			char buf[65536];
+			ssize_t r;
+			while (fd != -1)
+			{
+				if (timeout) {
+					struct pollfd pfd = { fd, POLLIN, 0 };
+					if (poll(&pfd, 1, timeout * 1000) == 0) {
+						stalled = true;
+						break;
+					}
+				}
+				if ((r = ::read(fd, buf, sizeof buf)) <= 0)
+					break;
+				data.append(buf, r);
+			}
+			if (fd != -1)
+				close(fd);
+
+			if (stalled)
+				process_kill(m_chunks[i].pid);
+			// -1 if it couldn't be spawned
+			int status = process_wait(m_chunks[i].pid);
+			lock.lock();
+			m_chunks[i].pid = -1;
+			if ((!stalled && status == 0) || m_stop)
+				break;
+			if (attempt >= 2) {
+				m_chunks[i].failed = true;
+				break;
+			}
+			if (stalled) {
+				syslog(LOG_WARNING, "Chunk %zu/%zu of %s stalled for %us, restarting",
+						i + 1, m_chunks.size(), m_path.c_str(), timeout);
+				metrics_count("transcode.chunk_stalled");
+			} else {
+				syslog(LOG_WARNING, "Chunk %zu/%zu of %s failed (status %d), restarting",
+						i + 1, m_chunks.size(), m_path.c_str(), status);
+				metrics_count("transcode.chunk_failed");
+			}
+		}
+		m_chunks[i].data.swap(data);
+		m_chunks[i].done = true;
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		syslog(LOG_DEBUG, "Chunk %zu/%zu of %s: %.1fs in %.1fs (%.2fx realtime)",
+				i + 1, m_chunks.size(), m_path.c_str(), m_chunks[i].length, elapsed,
+				elapsed > 0 ? m_chunks[i].length / elapsed : 0);
+		m_cond.notify_all();
+	}
+}
+
+void ChunkedTranscoder::feed()
+{
+	for (size_t i = 0; i < m_chunks.size(); ++i)
+	{
+		std::string data;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cond.wait(lock, [this, i]() {
+					return m_stop || m_chunks[i].done;
+				});
+			if (m_stop)
+				break;
+			if (m_chunks[i].failed) {
+				syslog(LOG_ERR, "Chunk %zu/%zu of %s failed, giving up",
+						i + 1, m_chunks.size(), m_path.c_str());
+				m_failed = true;
+				break;
+			}
+			data.swap(m_chunks[i].data);
+			m_current = i + 1;
+			m_cond.notify_all();
+		}
+		size_t w = 0;
+		while (w < data.size()) {
+			ssize_t r = write(m_in, data.data() + w, data.size() - w);
+			if (r <= 0)
+				break;
+			w += r;
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_bytes += w;
+		}
+		if (w != data.size())
+			break;
+	}
+	close(m_in);
+}
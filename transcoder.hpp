@@ -0,0 +1,148 @@
+#ifndef _TRANSCODER_HPP_
+#define _TRANSCODER_HPP_
+
+#include "keyframes.hpp"
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+std::string probe(const std::string& path);
+std::string probe_vcodec(const std::string& info);
+double probe_duration(const std::string& info);
+double probe_start(const std::string& info);
+double probe_bitrate(const std::string& info);
+
+// what ffmpeg reports with -progress: frames per second, speed (as a multiple
+// of realtime), output bitrate (bits/s), and the bytes and seconds written.
+// slow is set once the speed has stayed below realtime for a while.
+struct TranscodeProgress {
+	TranscodeProgress() : fps(0), speed(0), bitrate(0), bytes(0), time(0), slow(false) {}
+	double fps;
+	double speed;
+	double bitrate;
+	uint64_t bytes;
+	double time;
+	bool slow;
+};
+
+// parses the key=value blocks of ffmpeg -progress from fd, until EOF
+class ProgressReader {
+	public:
+		ProgressReader(int fd, const std::string& name);
+		~ProgressReader();
+
+		TranscodeProgress get() const;
+	private:
+		void run();
+		void update(const TranscodeProgress& progress);
+
+		int m_fd;
+		std::string m_name;
+		TranscodeProgress m_progress;
+		bool m_below;
+		std::chrono::steady_clock::time_point m_below_since;
+		mutable std::mutex m_mutex;
+		std::thread m_thread;
+};
+
+// a source of transcoded media, read() returns 0 at end of stream and -1 on
+// error, just like read(2). interrupt() makes a blocked read() return.
+// setPriority() sets the nice value of the transcoding processes.
+// getProgress() returns false if the transcoder doesn't report progress.
+// setStallTimeout() has the transcoder restart a process that produced no
+// output for seconds by itself, it returns false if it can't (a stalled
+// read() is then left to the caller to interrupt).
+class Transcoder {
+	public:
+		virtual ~Transcoder() {}
+		virtual ssize_t read(char* buf, size_t max) = 0;
+		virtual void interrupt() = 0;
+		virtual const char* getName() const = 0;
+		virtual double getBitrate() const { return 0; }
+		virtual void setPriority(int /*nice*/) {}
+		virtual bool getProgress(TranscodeProgress& /*progress*/) const { return false; }
+		virtual bool setStallTimeout(unsigned int /*seconds*/) { return false; }
+};
+
+// runs a single ffmpeg process and reads its stdout, with progress the
+// process reports on -progress pipe:3
+class ProcessTranscoder : public Transcoder {
+	public:
+		ProcessTranscoder(const std::vector<std::string>& args, double bitrate = 0, bool progress = false);
+		~ProcessTranscoder();
+
+		ssize_t read(char* buf, size_t max);
+		void interrupt();
+		const char* getName() const;
+		double getBitrate() const;
+		void setPriority(int nice);
+		bool getProgress(TranscodeProgress& progress) const;
+		int getFd() const;
+	private:
+		pid_t m_pid;
+		int m_fd;
+		double m_bitrate;
+		std::unique_ptr<ProgressReader> m_progress;
+};
+
+// splits the source into chunks which are transcoded by several ffmpeg
+// processes at once (ahead of the playhead), the chunks are concatenated in
+// order and remuxed into a single matroska stream.
+class ChunkedTranscoder : public Transcoder {
+	public:
+		ChunkedTranscoder(const std::string& path, double startTime, double duration,
+				unsigned int workers, unsigned int chunkSize, double bitrate = 0,
+				std::shared_ptr<const Keyframes> keyframes = std::shared_ptr<const Keyframes>());
+		~ChunkedTranscoder();
+
+		ssize_t read(char* buf, size_t max);
+		void interrupt();
+		const char* getName() const;
+		double getBitrate() const;
+		void setPriority(int nice);
+		bool getProgress(TranscodeProgress& progress) const;
+		bool setStallTimeout(unsigned int seconds);
+	private:
+		void work();
+		void feed();
+
+		struct Chunk {
+			double start;
+			double length;
+			std::string data;
+			bool done;
+			// every attempt failed or stalled, done then too
+			bool failed;
+			pid_t pid;
+		};
+
+		std::string m_path;
+		double m_bitrate;
+		unsigned int m_threads;
+		std::vector<Chunk> m_chunks;
+		size_t m_next;
+		size_t m_current;
+		size_t m_lookahead;
+		uint64_t m_bytes;
+		int m_nice;
+		unsigned int m_stall_timeout;
+		bool m_stop;
+		// a chunk failed, read() reports an error once the output is drained
+		bool m_failed;
+		std::chrono::steady_clock::time_point m_started;
+		pid_t m_pid;
+		int m_in;
+		int m_out;
+		std::vector<std::thread> m_workers;
+		std::thread m_feeder;
+		mutable std::mutex m_mutex;
+		std::condition_variable m_cond;
+};
+
+#endif
@@ -1,14 +1,25 @@
 #include "webserver.hpp"
+#include "transcoder.hpp"
+#include "avtranscoder.hpp"
+#include "supervisor.hpp"
+#include "process.hpp"
+#include "metrics.hpp"
+#include "zerocopy.hpp"
+#include "subtitles.hpp"
+#include "patharena.hpp"
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
-#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <json/json.h>
 #include <fstream>
 #include <streambuf>
 #include <syslog.h>
+#include <chrono>
+#include <memory>
 
-std::string execvp(const std::vector<std::string>& args, bool _stdout = true);
 extern const char* ffmpegpath();
 
 Webserver::Webserver(unsigned short port, ChromeCast& sender, Playlist& playlist)
@@ -16,6 +27,14 @@ Webserver::Webserver(unsigned short port, ChromeCast& sender, Playlist& playlist
 , m_sender(sender)
 , m_playlist(playlist)
 , m_seek(0.0)
+, m_workers(1)
+, m_chunk_size(30)
+, m_engine("process")
+, m_zero_copy(false)
+, m_prefetch_seconds(0)
+, m_stopping(false)
+, m_preload(0)
+, m_gap_pending(false)
 {
 	mp_d = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION,
 			port,
@@ -30,7 +49,26 @@ Webserver::Webserver(unsigned short port, ChromeCast& sender, Playlist& playlist
 
 Webserver::~Webserver()
 {
+	{
+		std::lock_guard<std::mutex> lock(m_worker_mutex);
+		m_stopping = true;
+		m_worker_cond.notify_all();
+	}
+	if (m_worker.joinable())
+		m_worker.join();
 	MHD_stop_daemon(mp_d);
+	stopHls();
+}
+
+// the REST API and the receiver know tracks by their uuid as text, anything
+// else is no track at all
+static TrackId track_id(const std::string& uuid)
+{
+	try {
+		return TrackId::parse(uuid);
+	} catch (std::runtime_error& e) {
+		return TrackId();
+	}
 }
 
 int mhd_queue_json(struct MHD_Connection* connection, int status_code, const Json::Value& json)
@@ -64,7 +102,8 @@ int Webserver::REST_API(struct MHD_Connection* connection,
 		void** ptr)
 {
 	std::string postdata;
-	if (strcmp(method, MHD_HTTP_METHOD_POST) == 0)
+	if (strcmp(method, MHD_HTTP_METHOD_POST) == 0 ||
+			strcmp(method, MHD_HTTP_METHOD_PUT) == 0)
 	{
 		PostRequest* request = static_cast<PostRequest*>(*ptr);
 		if (!request) {
@@ -95,6 +134,22 @@ int Webserver::REST_API(struct MHD_Connection* connection,
 	{
 		if (strcmp(url, "/playlist") == 0)
 			return POST_playlist(connection, postdata);
+		if (strcmp(url, "/playlist/apply") == 0)
+			return POST_playlist_apply(connection, postdata);
+		return MHD_NO;
+	}
+
+	if (strcmp(method, MHD_HTTP_METHOD_PUT) == 0)
+	{
+		if (strncmp(url, "/hls/", 5) == 0) {
+			std::string uuid = url + 5;
+			std::string::size_type slash = uuid.find('/');
+			if (slash == std::string::npos)
+				return MHD_NO;
+			std::string file = uuid.substr(slash + 1);
+			uuid.erase(slash);
+			return PUT_hls(connection, uuid, file, postdata);
+		}
 		return MHD_NO;
 	}
 
@@ -143,6 +198,8 @@ int Webserver::REST_API(struct MHD_Connection* connection,
 			return GET_next(connection);
 		if (strcmp(url, "/streaminfo") == 0)
 			return GET_streaminfo(connection);
+		if (strcmp(url, "/metrics") == 0)
+			return GET_metrics(connection);
 		if (strcmp(url, "/pause") == 0)
 			return GET_pause(connection);
 		if (strcmp(url, "/resume") == 0)
@@ -150,7 +207,7 @@ int Webserver::REST_API(struct MHD_Connection* connection,
 		if (strcmp(url, "/stop") == 0)
 			return GET_stop(connection);
 		if (strncmp(url, "/subtitles/", 11) == 0)
-			return GET_subtitles(connection, strcmp(url + 11, "1") == 0);
+			return GET_subtitles(connection, strtoul(url + 11, NULL, 10));
 		if (strcmp(url, "/playlist") == 0)
 			return GET_playlist(connection);
 		if (strncmp(url, "/playlist/repeat/", 17) == 0)
@@ -189,6 +246,16 @@ int Webserver::REST_API(struct MHD_Connection* connection,
 
 			return GET_subs(connection, uuid, startTime);
 		}
+		if (strncmp(url, "/hls/", 5) == 0) {
+			// /hls/uuid/file
+			std::string uuid = url + 5;
+			std::string::size_type slash = uuid.find('/');
+			if (slash == std::string::npos)
+				return MHD_NO;
+			std::string file = uuid.substr(slash + 1);
+			uuid.erase(slash);
+			return GET_hls(connection, uuid, file);
+		}
 	}
 	return MHD_NO;
 }
@@ -223,14 +290,76 @@ int Webserver::POST_playlist(struct MHD_Connection* connection, const std::strin
 		return mhd_queue_json(connection, 403, Json::Value());
 
 	Json::Value json;
-	{
-		std::lock_guard<std::mutex> lock(m_playlist.getMutex());
-
+	if (!PathArena::isValid(data))
+		return mhd_queue_json(connection, 400, json);
+	try {
 		PlaylistItem track(data);
-		m_playlist.insert(track);
+		m_playlist.apply({ PlaylistOperation::insert(track) });
+		json["uuid"] = track.getId().str();
+	} catch (std::runtime_error& e) {
+		json["error"] = e.what();
+		return mhd_queue_json(connection, 400, json);
+	}
+	syncQueue();
+	return mhd_queue_json(connection, MHD_HTTP_OK, json);
+}
+
+// a list of changes that are applied at once, or not at all
+// [ { "op": "insert", "path": "..." }, { "op": "remove", "uuid": "..." },
+//   { "op": "queue", "uuid": "..." }, { "op": "move", "uuid": "...", "before": "..." },
+//   { "op": "repeat", "value": true }, ... ]
+int Webserver::POST_playlist_apply(struct MHD_Connection* connection, const std::string& data)
+{
+	if (!isPrivileged(connection))
+		return mhd_queue_json(connection, 403, Json::Value());
+
+	Json::Value request;
+	Json::Reader reader;
+	if (!reader.parse(data, request, false) || !request.isArray())
+		return mhd_queue_json(connection, 400, Json::Value());
 
-		json["uuid"] = track.getUUID();
+	Json::Value json;
+	Json::Value uuids(Json::arrayValue);
+	std::vector<PlaylistOperation> operations;
+	try {
+		for (auto& operation : request)
+		{
+			std::string op = operation["op"].asString();
+			if (op == "insert") {
+				std::string path = operation["path"].asString();
+				if (!PathArena::isValid(path))
+					throw std::runtime_error("path too long");
+				PlaylistItem track(path);
+				operations.push_back(PlaylistOperation::insert(track));
+				uuids.append(track.getId().str());
+			} else if (op == "remove")
+				operations.push_back(PlaylistOperation::remove(track_id(operation["uuid"].asString())));
+			else if (op == "queue")
+				operations.push_back(PlaylistOperation::queue(track_id(operation["uuid"].asString())));
+			else if (op == "move")
+				operations.push_back(PlaylistOperation::move(track_id(operation["uuid"].asString()),
+						track_id(operation["before"].asString())));
+			else if (op == "repeat")
+				operations.push_back(PlaylistOperation::repeat(operation["value"].asBool()));
+			else if (op == "repeatall")
+				operations.push_back(PlaylistOperation::repeatAll(operation["value"].asBool()));
+			else if (op == "shuffle")
+				operations.push_back(PlaylistOperation::shuffle(operation["value"].asBool()));
+			else
+				throw std::runtime_error("unknown operation");
+		}
+	} catch (std::runtime_error& e) {
+		json["error"] = e.what();
+		return mhd_queue_json(connection, 400, json);
 	}
+	try {
+		json["version"] = (Json::UInt64)m_playlist.apply(operations)->getVersion();
+	} catch (std::runtime_error& e) {
+		json["error"] = e.what();
+		return mhd_queue_json(connection, 500, json);
+	}
+	json["uuids"] = uuids;
+	syncQueue();
 	return mhd_queue_json(connection, MHD_HTTP_OK, json);
 }
 
@@ -239,76 +368,65 @@ int Webserver::DELETE_playlist(struct MHD_Connection* connection, const std::str
 	if (!isPrivileged(connection))
 		return mhd_queue_json(connection, 403, Json::Value());
 
-	std::lock_guard<std::mutex> lock(m_playlist.getMutex());
-	m_playlist.remove(uuid);
-
+	m_playlist.apply({ PlaylistOperation::remove(track_id(uuid)) });
+	syncQueue();
 	return mhd_queue_json(connection, MHD_HTTP_OK, Json::Value());
 }
 
 int Webserver::GET_playlist(struct MHD_Connection* connection)
 {
 	Json::Value json;
+	// serialized from a snapshot, without blocking the writers
+	std::shared_ptr<const PlaylistSnapshot> playlist = m_playlist.getSnapshot();
+	json["version"] = (Json::UInt64)playlist->getVersion();
+	json["repeat"] = playlist->getRepeat();
+	json["repeatall"] = playlist->getRepeatAll();
+	json["shuffle"] = playlist->getShuffle();
+	Json::Value tracklist(Json::arrayValue);
+	for (auto& track : playlist->getTracks())
 	{
-		std::lock_guard<std::mutex> lock(m_playlist.getMutex());
-
-		json["uuid"] = m_playlist.getUUID();
-		json["repeat"] = m_playlist.getRepeat();
-		json["repeatall"] = m_playlist.getRepeatAll();
-		json["shuffle"] = m_playlist.getShuffle();
-		Json::Value tracklist(Json::arrayValue);
-		for (auto& track : m_playlist.getTracks())
-		{
-			Json::Value t;
-			t["name"] = track.getName();
-			t["uuid"] = track.getUUID();
-			tracklist.append(t);
-		}
-		json["tracks"] = tracklist;
-		Json::Value queuelist(Json::arrayValue);
-		for (auto& uuid : m_playlist.getQueue())
-		{
-			Json::Value t;
-			t["uuid"] = uuid;
-			queuelist.append(t);
-		}
-		json["queue"] = queuelist;
+		Json::Value t;
+		t["name"] = track.getName();
+		t["uuid"] = track.getId().str();
+		if (track.getDuration() >= 0)
+			t["duration"] = track.getDuration();
+		if (playlist->isQueued(track.getId()))
+			t["queued"] = true;
+		tracklist.append(t);
 	}
+	json["tracks"] = tracklist;
+	Json::Value queuelist(Json::arrayValue);
+	for (auto& uuid : playlist->getQueue())
+	{
+		Json::Value t;
+		t["uuid"] = uuid.str();
+		queuelist.append(t);
+	}
+	json["queue"] = queuelist;
 	return mhd_queue_json(connection, MHD_HTTP_OK, json);
 }
 
 int Webserver::GET_playlist_repeat(struct MHD_Connection* connection, bool value)
 {
 	Json::Value json;
-	{
-		std::lock_guard<std::mutex> lock(m_playlist.getMutex());
-
-		m_playlist.setRepeat(value);
-		json["repeat"] = m_playlist.getRepeat();
-	}
+	json["repeat"] = m_playlist.apply({ PlaylistOperation::repeat(value) })->getRepeat();
+	syncQueue();
 	return mhd_queue_json(connection, MHD_HTTP_OK, json);
 }
 
 int Webserver::GET_playlist_repeatall(struct MHD_Connection* connection, bool value)
 {
 	Json::Value json;
-	{
-		std::lock_guard<std::mutex> lock(m_playlist.getMutex());
-
-		m_playlist.setRepeatAll(value);
-		json["repeatall"] = m_playlist.getRepeatAll();
-	}
+	json["repeatall"] = m_playlist.apply({ PlaylistOperation::repeatAll(value) })->getRepeatAll();
+	syncQueue();
 	return mhd_queue_json(connection, MHD_HTTP_OK, json);
 }
 
 int Webserver::GET_playlist_shuffle(struct MHD_Connection* connection, bool value)
 {
 	Json::Value json;
-	{
-		std::lock_guard<std::mutex> lock(m_playlist.getMutex());
-
-		m_playlist.setShuffle(value);
-		json["shuffle"] = m_playlist.getShuffle();
-	}
+	json["shuffle"] = m_playlist.apply({ PlaylistOperation::shuffle(value) })->getShuffle();
+	syncQueue();
 	return mhd_queue_json(connection, MHD_HTTP_OK, json);
 }
 
@@ -333,9 +451,9 @@ int Webserver::GET_stop(struct MHD_Connection* connection)
 	return mhd_queue_json(connection, MHD_HTTP_OK, Json::Value());
 }
 
-int Webserver::GET_subtitles(struct MHD_Connection* connection, bool value)
+int Webserver::GET_subtitles(struct MHD_Connection* connection, unsigned int trackId)
 {
-	if (!m_sender.setSubtitles(value))
+	if (!m_sender.setSubtitles(trackId))
 		return mhd_queue_json(connection, 500, Json::Value());
 	return mhd_queue_json(connection, MHD_HTTP_OK, Json::Value());
 }
@@ -358,19 +476,15 @@ int Webserver::GET_play(struct MHD_Connection* connection, const std::string& uu
 {
 	std::string name;
 	try {
-		std::lock_guard<std::mutex> lock(m_playlist.getMutex());
-
-		const PlaylistItem& track = m_playlist.getTrack(uuid);
+		std::shared_ptr<const PlaylistSnapshot> playlist = m_playlist.getSnapshot();
+		const PlaylistItem& track = playlist->getTrack(track_id(uuid));
 		name = track.getName();
 	} catch (std::runtime_error& e) {
 		Json::Value json;
 		json["error"] = e.what();
 		return mhd_queue_json(connection, 500, json);
 	}
-	if (!m_sender.load(
-			"http://" + m_sender.getSocketName() + ":" + std::to_string(m_port) + "/stream/" + uuid +
-				(startTime ? "/" + std::to_string(startTime) : ""),
-			name, uuid))
+	if (!load(uuid, name, startTime))
 		return mhd_queue_json(connection, 500, Json::Value());
 	return mhd_queue_json(connection, MHD_HTTP_OK, Json::Value());
 }
@@ -378,14 +492,13 @@ int Webserver::GET_play(struct MHD_Connection* connection, const std::string& uu
 int Webserver::GET_queue(struct MHD_Connection* connection, const std::string& uuid)
 {
 	try {
-		std::lock_guard<std::mutex> lock(m_playlist.getMutex());
-
-		m_playlist.queueTrack(uuid);
+		m_playlist.apply({ PlaylistOperation::queue(track_id(uuid)) });
 	} catch (std::runtime_error& e) {
 		Json::Value json;
 		json["error"] = e.what();
 		return mhd_queue_json(connection, 500, json);
 	}
+	syncQueue();
 	return mhd_queue_json(connection, MHD_HTTP_OK, Json::Value());
 }
 
@@ -393,56 +506,528 @@ int Webserver::GET_next(struct MHD_Connection* connection)
 {
 	Json::Value json;
 	std::string name, uuid;
-	try {
-		std::lock_guard<std::mutex> lock(m_playlist.getMutex());
 
-		const PlaylistItem& track = m_playlist.getNextTrack(m_sender.getUUID());
+	// skip to the track that is already preloaded on the receiver
+	{
+		std::unique_lock<std::mutex> lock(m_queue_mutex);
+		std::string queued = m_queued;
+		bool playing = !m_current.empty() && m_sender.getUUID() == m_current;
+		lock.unlock();
+		if (!queued.empty() && playing && m_sender.queueUpdate(1)) {
+			json["uuid"] = queued;
+			return mhd_queue_json(connection, MHD_HTTP_OK, json);
+		}
+	}
+
+	try {
+		PlaylistItem track = m_playlist.getNextTrack(track_id(m_sender.getUUID()));
 		name = track.getName();
-		uuid = track.getUUID();
+		uuid = track.getId().str();
 		json["uuid"] = uuid;
 	} catch (std::runtime_error& e) {
 		Json::Value json;
 		json["error"] = e.what();
 		return mhd_queue_json(connection, 500, json);
 	}
-	if (!m_sender.load(
-			"http://" + m_sender.getSocketName() + ":" + std::to_string(m_port) + "/stream/" + uuid,
-			name, uuid))
+	if (!load(uuid, name))
 		return mhd_queue_json(connection, 500, Json::Value());
 	return mhd_queue_json(connection, MHD_HTTP_OK, json);
 }
 
-struct mhd_forkctx
+// Cast wants RFC 5646 languages, ffmpeg reports ISO 639-2
+static std::string language(const std::string& lang)
+{
+	static const char* languages[][2] = {
+		{ "eng", "en" }, { "fre", "fr" }, { "fra", "fr" }, { "ger", "de" }, { "deu", "de" },
+		{ "spa", "es" }, { "ita", "it" }, { "por", "pt" }, { "dut", "nl" }, { "nld", "nl" },
+		{ "swe", "sv" }, { "nor", "no" }, { "dan", "da" }, { "fin", "fi" }, { "pol", "pl" },
+		{ "cze", "cs" }, { "ces", "cs" }, { "rus", "ru" }, { "jpn", "ja" }, { "chi", "zh" },
+		{ "zho", "zh" }, { "kor", "ko" },
+	};
+	for (auto& l : languages)
+		if (lang == l[0])
+			return l[1];
+	return lang;
+}
+
+ChromeCast::Media Webserver::createMedia(const std::string& uuid, const std::string& name,
+		const std::string& path, time_t startTime)
+{
+	std::string base = "http://" + m_sender.getSocketName() + ":" + std::to_string(m_port);
+	std::string subs;
+	ChromeCast::Media media;
+	media.title = name;
+	media.uuid = uuid;
+	if (!m_hls_type.empty()) {
+		// the HLS timeline is absolute, so seeking is left to the receiver
+		media.url = base + "/hls/" + uuid + "/index.m3u8";
+		subs = base + "/subs/" + uuid;
+		media.contentType = "application/x-mpegURL";
+		media.segmentFormat = m_hls_type;
+		media.currentTime = startTime;
+	} else {
+		std::string seek = startTime ? "/" + std::to_string(startTime) : "";
+		media.url = base + "/stream/" + uuid + seek;
+		subs = base + "/subs/" + uuid + seek;
+		m_keyframes.build(path);
+	}
+
+	// a sidecar file is the first track, followed by the embedded ones
+	if (!subtitles_sidecar(path).empty()) {
+		ChromeCast::TextTrack track;
+		track.url = subs;
+		media.textTracks.push_back(track);
+	}
+	std::vector<SubtitleStream> streams = probe_subtitles(probe(path));
+	for (auto& stream : streams) {
+		ChromeCast::TextTrack track;
+		track.url = subs + "?track=" + std::to_string(stream.index);
+		track.language = language(stream.language);
+		track.name = !stream.title.empty() ? stream.title :
+			!stream.language.empty() ? stream.language :
+			"Track " + std::to_string(stream.index + 1);
+		media.textTracks.push_back(track);
+	}
+	m_subtitles.extract(path, streams);
+	if (media.textTracks.empty()) {
+		ChromeCast::TextTrack track;
+		track.url = subs;
+		media.textTracks.push_back(track);
+	}
+	return media;
+}
+
+bool Webserver::load(const std::string& uuid, const std::string& name, time_t startTime)
+{
+	std::string path;
+	try {
+		path = m_playlist.getSnapshot()->getTrack(track_id(uuid)).getPath();
+	} catch (std::runtime_error& e) {
+		return false;
+	}
+	ChromeCast::Media media = createMedia(uuid, name, path, startTime);
+
+	// with gapless playback the receiver gets the next track up front, the
+	// HLS transcode of a track can't run ahead of the current one though
+	if (m_preload && m_hls_type.empty()) {
+		std::vector<ChromeCast::Media> items;
+		items.push_back(media);
+		std::string next, nextName, nextPath;
+		try {
+			PlaylistItem track = m_playlist.peekNextTrack(track_id(uuid));
+			next = track.getId().str();
+			nextName = track.getName();
+			nextPath = track.getPath();
+		} catch (std::runtime_error& e) {
+			// last track
+		}
+		if (!next.empty())
+			items.push_back(createMedia(next, nextName, nextPath, 0));
+		{
+			std::lock_guard<std::mutex> lock(m_queue_mutex);
+			m_current = uuid;
+			m_queued = next;
+		}
+		if (!m_sender.queueLoad(items, m_preload))
+			return false;
+	} else {
+		{
+			std::lock_guard<std::mutex> lock(m_queue_mutex);
+			m_current = uuid;
+			m_queued.clear();
+		}
+		if (!m_sender.load(media))
+			return false;
+	}
+
+	if (m_prefetch_seconds && m_hls_type.empty()) {
+		// let the stream that was just loaded get going first
+		post([this, uuid]() {
+				if (m_sender.getUUID() == uuid)
+					prefetch(uuid);
+			}, 5);
+	}
+	return true;
+}
+
+// called from the receiver's connection (so anything talking to the
+// receiver has to be done from another thread)
+void Webserver::mediaStatus(const std::string& playerState, const std::string& idleReason, const std::string& uuid)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> lock(m_queue_mutex);
+
+	if (playerState == "IDLE") {
+		if (idleReason != "FINISHED")
+			return;
+		if (!m_gap_pending) {
+			m_gap_pending = true;
+			m_track_ended = now;
+		}
+		if (!m_queued.empty()) {
+			// the receiver moves on to the preloaded track by itself, unless it
+			// failed to, then load it the old way
+			std::string queued = m_queued;
+			post([this, uuid, queued]() {
+					if (m_sender.getUUID() != queued) {
+						syslog(LOG_DEBUG, "Receiver did not continue with %s", queued.c_str());
+						playNext(uuid);
+					}
+				}, 3);
+			return;
+		}
+		lock.unlock();
+		post([this, uuid]() {
+				playNext(uuid);
+			});
+		return;
+	}
+
+	if (uuid.empty())
+		return;
+
+	if (uuid != m_current) {
+		if (!m_current.empty() && !m_gap_pending) {
+			m_gap_pending = true;
+			m_track_ended = now;
+		}
+		std::string previous = m_current;
+		m_current = uuid;
+		if (uuid == m_queued) {
+			m_queued.clear();
+			post([this, previous, uuid]() {
+					try {
+						// keep the playlist (queue and shuffle) in step with the receiver
+						m_playlist.getNextTrack(track_id(previous));
+					} catch (std::runtime_error& e) {
+					}
+					unsigned int itemId = m_sender.getItemId(previous);
+					if (itemId)
+						m_sender.queueRemove({ itemId });
+					syncQueue();
+					if (m_prefetch_seconds)
+						prefetch(uuid);
+				});
+		}
+	}
+
+	if (playerState == "PLAYING" && m_gap_pending) {
+		m_gap_pending = false;
+		double gap = std::chrono::duration<double>(now - m_track_ended).count();
+		syslog(LOG_DEBUG, "%.2fs between tracks", gap);
+		metrics_timing("playback.gap", gap);
+	}
+}
+
+void Webserver::playNext(const std::string& uuid)
+{
+	std::string next, name;
+	try {
+		PlaylistItem track = m_playlist.getNextTrack(track_id(uuid));
+		next = track.getId().str();
+		name = track.getName();
+	} catch (std::runtime_error& e) {
+		return;
+	}
+	load(next, name);
+}
+
+// a stream the watchdog stopped is loaded again where the receiver is, the
+// seek goes through the keyframe index so it resumes at a known keyframe
+void Webserver::restartStalled(const std::string& key, double stalled)
+{
+	std::string uuid = key.substr(0, key.find('/'));
+	if (uuid != m_sender.getUUID())
+		return;
+	double position = m_seek + m_sender.getPlayerCurrentTime();
+	std::string name;
+	try {
+		name = m_playlist.getSnapshot()->getTrack(track_id(uuid)).getName();
+	} catch (std::runtime_error& e) {
+		return;
+	}
+	syslog(LOG_WARNING, "Restarting %s at %.1fs after a %.1fs stall", name.c_str(), position, stalled);
+	metrics_timing("stream.stall", stalled);
+	post([this, uuid, name, position]() {
+			auto begin = std::chrono::steady_clock::now();
+			load(uuid, name, (time_t)position);
+			double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+			syslog(LOG_DEBUG, "Restarted %s in %.1fs", name.c_str(), elapsed);
+			metrics_timing("stream.restart", elapsed);
+		});
+}
+
+// mirror the next track of the playlist into the receiver's queue
+void Webserver::syncQueue()
+{
+	if (!m_preload || !m_hls_type.empty())
+		return;
+
+	std::string current, queued;
+	{
+		std::lock_guard<std::mutex> lock(m_queue_mutex);
+		current = m_current;
+		queued = m_queued;
+	}
+	if (current.empty() || m_sender.getUUID() != current)
+		return;
+
+	std::string next, name, path;
+	try {
+		PlaylistItem track = m_playlist.peekNextTrack(track_id(current));
+		next = track.getId().str();
+		name = track.getName();
+		path = track.getPath();
+	} catch (std::runtime_error& e) {
+		// last track
+	}
+	if (next == queued)
+		return;
+
+	if (!queued.empty()) {
+		unsigned int itemId = m_sender.getItemId(queued);
+		if (itemId)
+			m_sender.queueRemove({ itemId });
+		else
+			syslog(LOG_ERR, "Queued item %s not found on the receiver", queued.c_str());
+	}
+	if (!next.empty())
+		m_sender.queueInsert({ createMedia(next, name, path, 0) }, m_preload);
+
+	std::lock_guard<std::mutex> lock(m_queue_mutex);
+	m_queued = next;
+}
+
+void Webserver::post(const std::function<void()>& task, unsigned int delay)
+{
+	std::lock_guard<std::mutex> lock(m_worker_mutex);
+	if (m_stopping)
+		return;
+	m_tasks.insert(std::make_pair(std::chrono::steady_clock::now() + std::chrono::seconds(delay), task));
+	if (!m_worker.joinable())
+		m_worker = std::thread(&Webserver::worker, this);
+	m_worker_cond.notify_all();
+}
+
+// tasks run one at a time in the order they are due, those still waiting
+// when the webserver goes away are dropped
+void Webserver::worker()
+{
+	std::unique_lock<std::mutex> lock(m_worker_mutex);
+	while (!m_stopping)
+	{
+		if (m_tasks.empty())
+			m_worker_cond.wait(lock);
+		else if (std::chrono::steady_clock::now() < m_tasks.begin()->first)
+			m_worker_cond.wait_until(lock, m_tasks.begin()->first);
+		else {
+			std::function<void()> task = m_tasks.begin()->second;
+			m_tasks.erase(m_tasks.begin());
+			lock.unlock();
+			task();
+			lock.lock();
+		}
+	}
+}
+
+void Webserver::prefetch(const std::string& uuid)
+{
+	std::string next, path;
+	try {
+		PlaylistItem track = m_playlist.peekNextTrack(track_id(uuid));
+		next = track.getId().str();
+		path = track.getPath();
+	} catch (std::runtime_error& e) {
+		return;
+	}
+
+	// spliced streams do not go through the supervisor, warm up the probe
+	if (m_zero_copy && m_engine == "process" && probe_vcodec(probe(path)) == "copy")
+		return;
+
+	m_supervisor.prefetch(streamKey(next, 0), [this, path]() {
+			return createTranscoder(path, 0);
+		}, m_prefetch_seconds);
+}
+
+std::string Webserver::streamKey(const std::string& uuid, double startTime) const
 {
-	pid_t pid;
-	int fd;
+	// the same track, position and transcoding setup shares one job
+	return uuid + "/" + std::to_string(startTime) + "/" + m_engine +
+		"/" + std::to_string(m_workers) + "/" + std::to_string(m_chunk_size);
+}
+
+void Webserver::setHlsSegmentType(const std::string& type)
+{
+	if (!isHlsSegmentType(type))
+		throw std::runtime_error("unknown hls segment type: " + type);
+	m_hls_type = type;
+}
+
+// an empty type disables hls
+bool Webserver::isHlsSegmentType(const std::string& type)
+{
+	return type.empty() || type == "ts" || type == "fmp4";
+}
+
+void Webserver::setHlsMemoryLimit(size_t bytes)
+{
+	m_segments.setMaxSize(bytes);
+}
+
+void Webserver::setTranscodeWorkers(unsigned int workers)
+{
+	m_workers = std::max(1u, workers);
+}
+
+void Webserver::setChunkSize(unsigned int seconds)
+{
+	m_chunk_size = std::max(1u, seconds);
+}
+
+void Webserver::setMaxStreams(unsigned int streams)
+{
+	m_supervisor.setMaxJobs(streams);
+}
+
+void Webserver::setReadAhead(size_t bytes, unsigned int seconds)
+{
+	m_supervisor.setReadAhead(bytes, seconds);
+}
+
+void Webserver::setEngine(const std::string& engine)
+{
+	if (!isEngine(engine))
+		throw std::runtime_error("unsupported engine: " + engine);
+	m_engine = engine;
+}
+
+// libav is only available when built with it
+bool Webserver::isEngine(const std::string& engine)
+{
+#ifdef HAVE_LIBAV
+	return engine == "process" || engine == "libav";
+#else
+	return engine == "process";
+#endif
+}
+
+void Webserver::setZeroCopy(bool value)
+{
+	m_zero_copy = value;
+}
+
+void Webserver::setPrefetch(unsigned int seconds)
+{
+	m_prefetch_seconds = seconds;
+}
+
+void Webserver::setStallTimeout(unsigned int seconds)
+{
+	m_supervisor.setStallTimeout(seconds, [this](const std::string& key, double stalled) {
+			restartStalled(key, stalled);
+		});
+}
+
+void Webserver::setGapless(unsigned int preloadTime)
+{
+	m_preload = preloadTime;
+}
+
+void Webserver::setIndexDirectory(const std::string& dir)
+{
+	m_keyframes.setDirectory(dir);
+}
+
+struct mhd_transcoderctx
+{
+	std::unique_ptr<Transcoder> transcoder;
+	uint64_t bytes;
+	std::chrono::steady_clock::time_point started;
 };
 
-void mhd_forkctx_clean(void* cls)
+mhd_transcoderctx* mhd_transcoderctx_create(Transcoder* transcoder)
 {
-	mhd_forkctx* f = static_cast<mhd_forkctx*>(cls);
-	int status;
-	kill(f->pid, SIGKILL);
-	waitpid(f->pid, &status, 0);
-	close(f->fd);
-	delete f;
+	mhd_transcoderctx* t = new mhd_transcoderctx;
+	t->transcoder.reset(transcoder);
+	t->bytes = 0;
+	t->started = std::chrono::steady_clock::now();
+	return t;
 }
 
-ssize_t mhd_forkctx_read(void* cls, uint64_t pos, char* buf, size_t max)
+void mhd_transcoder_clean(void* cls)
 {
-	mhd_forkctx* f = static_cast<mhd_forkctx*>(cls);
-	int r = read(f->fd, buf, max);
+	mhd_transcoderctx* t = static_cast<mhd_transcoderctx*>(cls);
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t->started).count();
+	syslog(LOG_DEBUG, "Streamed %llu bytes in %.1fs (%.2f MB/s, %s)",
+			(unsigned long long)t->bytes, elapsed,
+			elapsed > 0 ? t->bytes / elapsed / (1024 * 1024) : 0, t->transcoder->getName());
+	metrics_count(std::string("stream.bytes.") + t->transcoder->getName(), t->bytes);
+	metrics_timing(std::string("stream.") + t->transcoder->getName(), elapsed);
+	delete t;
+}
+
+ssize_t mhd_transcoder_read(void* cls, uint64_t pos, char* buf, size_t max)
+{
+	mhd_transcoderctx* t = static_cast<mhd_transcoderctx*>(cls);
+	ssize_t r = t->transcoder->read(buf, max);
 	if (r == 0)
 		return MHD_CONTENT_READER_END_OF_STREAM;
+	if (r < 0)
+		return MHD_CONTENT_READER_END_WITH_ERROR;
+	t->bytes += r;
 	return r;
 }
 
+std::vector<std::string> stream_args(const std::string& path, double startTime, const std::string& vcodec)
+{
+	std::vector<std::string> args;
+	args.push_back(ffmpegpath());
+	args.push_back("-y");
+	if (startTime > 0) {
+		args.push_back("-ss"); args.push_back(std::to_string(startTime));
+	}
+	args.push_back("-i"); args.push_back(path);
+	args.push_back("-vcodec"); args.push_back(vcodec);
+	args.push_back("-acodec"); args.push_back("aac");
+//	args.push_back("-scodec"); args.push_back("webvtt");
+	args.push_back("-strict"); args.push_back("-2");
+	args.push_back("-f"); args.push_back("matroska");
+//	args.push_back("-aspect"); args.push_back("16:9");
+	args.push_back("-");
+	return args;
+}
+
+Transcoder* Webserver::createTranscoder(const std::string& path, double startTime)
+{
+#ifdef HAVE_LIBAV
+	if (m_engine == "libav") {
+		try {
+			return new LibavTranscoder(path, startTime);
+		} catch (std::runtime_error& e) {
+			syslog(LOG_ERR, "libav engine failed for %s: %s", path.c_str(), e.what());
+		}
+	}
+#endif
+
+	std::string info = probe(path);
+	std::string vcodec = probe_vcodec(info);
+	double duration = probe_duration(info);
+	double bitrate = probe_bitrate(info);
+
+	if (vcodec != "copy" && m_workers > 1 && duration > startTime)
+		return new ChunkedTranscoder(path, startTime, duration, m_workers, m_chunk_size, bitrate,
+				m_keyframes.get(path));
+
+	return new ProcessTranscoder(stream_args(path, startTime, vcodec), bitrate, true);
+}
+
 int Webserver::GET_stream(struct MHD_Connection* connection, const std::string& uuid, time_t startTime)
 {
 	std::string path;
 	try {
-		std::lock_guard<std::mutex> lock(m_playlist.getMutex());
-		const PlaylistItem& track = m_playlist.getTrack(uuid);
+		std::shared_ptr<const PlaylistSnapshot> playlist = m_playlist.getSnapshot();
+		const PlaylistItem& track = playlist->getTrack(track_id(uuid));
 		path = track.getPath();
 	} catch (std::runtime_error& e) {
 		Json::Value json;
@@ -450,52 +1035,106 @@ int Webserver::GET_stream(struct MHD_Connection* connection, const std::string&
 		return mhd_queue_json(connection, 500, json);
 	}
 
-	m_seek = startTime;
-
-	std::string info = execvp({ffmpegpath(), "-i", path}, false);
-	std::string vcodec = "h264";
-	if (info.find("Video: h264") != std::string::npos)
-		vcodec = "copy";
-
-	std::string time = std::to_string(startTime);
-	std::vector<const char*> cbuf;
-	cbuf.push_back(ffmpegpath());
-	cbuf.push_back("-y");
-	if (startTime) {
-		cbuf.push_back("-ss"); cbuf.push_back(time.c_str());
-	}
-	cbuf.push_back("-i"); cbuf.push_back(path.c_str());
-	cbuf.push_back("-vcodec"); cbuf.push_back(vcodec.c_str());
-	cbuf.push_back("-acodec"); cbuf.push_back("aac");
-//	cbuf.push_back("-scodec"); cbuf.push_back("webvtt");
-	cbuf.push_back("-strict"); cbuf.push_back("-2");
-	cbuf.push_back("-f"); cbuf.push_back("matroska");
-//	cbuf.push_back("-aspect"); cbuf.push_back("16:9");
-	cbuf.push_back("-");
-	cbuf.push_back(0);
-
-	std::string cmd;
-	for (auto i: cbuf) { if (i != cbuf[0]) cmd += " "; if (i) cmd += i; }
-	syslog(LOG_DEBUG, "Command: %s", cmd.c_str());
-
-	int mypipe[2];
-	pipe(mypipe);
-	pid_t pid = fork();
-	if (pid == (pid_t)0)
-	{
-		close(mypipe[0]);
-		close(fileno(stderr));
-		dup2(mypipe[1], fileno(stdout));
-		execvp(cbuf[0], (char* const*)&cbuf[0]);
-		_exit(1);
-	}
-	close(mypipe[1]);
-	mhd_forkctx* f = new mhd_forkctx;
-	f->pid = pid;
-	f->fd = mypipe[0];
-	MHD_Response* response = MHD_create_response_from_callback(-1, 8192, &mhd_forkctx_read, f, &mhd_forkctx_clean);
+	// start at a keyframe (once the file is indexed), so the position is
+	// exactly where the stream restarts instead of wherever ffmpeg snaps to
+	m_keyframes.build(path);
+	double start = m_keyframes.snap(path, startTime);
+	m_seek = start;
+
+	// a spliced stream counts against the jobs limit, without a free slot
+	// it goes through the supervisor (which waits for one) instead
+	if (m_zero_copy && m_engine == "process") {
+		std::string info = probe(path);
+		if (probe_vcodec(info) == "copy" && m_supervisor.reserve(streamKey(uuid, start))) {
+			int ret;
+			try {
+				ret = GET_stream_zerocopy(connection, path, start);
+			} catch (...) {
+				m_supervisor.release();
+				throw;
+			}
+			m_supervisor.release();
+			return ret;
+		}
+	}
+
+	std::shared_ptr<StreamJob> job = m_supervisor.acquire(streamKey(uuid, start), [this, &path, start]() {
+			return createTranscoder(path, start);
+		});
+	if (!job) {
+		Json::Value json;
+		json["error"] = "too many streams";
+		return mhd_queue_json(connection, MHD_HTTP_SERVICE_UNAVAILABLE, json);
+	}
+
+	mhd_transcoderctx* t = mhd_transcoderctx_create(new StreamConsumer(job));
+	MHD_Response* response = MHD_create_response_from_callback(-1, 256 * 1024, &mhd_transcoder_read, t, &mhd_transcoder_clean);
 	MHD_add_response_header(response, "Content-Type", "video/x-matroska");
 	MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+	MHD_add_response_header(response, "X-Start-Time", std::to_string(start).c_str());
+	int ret = MHD_queue_response(connection,
+			MHD_HTTP_OK,
+			response);
+	MHD_destroy_response(response);
+	return ret;
+}
+
+/*
+ * Remux-only streams are moved from the ffmpeg pipe to the client socket with
+ * splice(), bypassing both the ring buffer and the microhttpd response buffer.
+ * This relies on MHD_USE_THREAD_PER_CONNECTION: the socket is ours for as long
+ * as this handler runs, so we write the response ourselves and let microhttpd
+ * close the connection.
+ */
+int Webserver::GET_stream_zerocopy(struct MHD_Connection* connection, const std::string& path, double startTime)
+{
+	const union MHD_ConnectionInfo* ci = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CONNECTION_FD);
+	if (!ci)
+		return MHD_NO;
+	int sock = ci->connect_fd;
+
+	ProcessTranscoder t(stream_args(path, startTime, "copy"));
+
+	// blocking, but not forever on a client that stopped reading
+	int flags = fcntl(sock, F_GETFL);
+	if (flags != -1)
+		fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+	struct timeval timeout = { ZeroCopySendTimeout, 0 };
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+	std::string header = "HTTP/1.1 200 OK\r\n"
+		"Content-Type: video/x-matroska\r\n"
+		"Access-Control-Allow-Origin: *\r\n"
+		"X-Start-Time: " + std::to_string(startTime) + "\r\n"
+		"Connection: close\r\n\r\n";
+	size_t w = 0;
+	while (w < header.size()) {
+		ssize_t n = write(sock, header.data() + w, header.size() - w);
+		if (n <= 0)
+			return MHD_NO;
+		w += n;
+	}
+
+	std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+	uint64_t bytes = zerocopy_transfer(t.getFd(), sock);
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+	syslog(LOG_DEBUG, "Streamed %llu bytes in %.1fs (%.2f MB/s, splice)",
+			(unsigned long long)bytes, elapsed,
+			elapsed > 0 ? bytes / elapsed / (1024 * 1024) : 0);
+	metrics_count("stream.bytes.splice", bytes);
+	metrics_timing("stream.splice", elapsed);
+
+	// the response is complete, have microhttpd drop the connection
+	return MHD_NO;
+}
+
+int mhd_queue_vtt(struct MHD_Connection* connection, const std::string& vtt)
+{
+	MHD_Response* response = MHD_create_response_from_buffer(vtt.size(),
+			(void*)vtt.c_str(),
+			MHD_RESPMEM_MUST_COPY);
+	MHD_add_response_header(response, "Content-Type", "text/vtt;charset=utf-8");
+	MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
 	int ret = MHD_queue_response(connection,
 			MHD_HTTP_OK,
 			response);
@@ -507,8 +1146,8 @@ int Webserver::GET_subs(struct MHD_Connection* connection, const std::string& uu
 {
 	std::string path;
 	try {
-		std::lock_guard<std::mutex> lock(m_playlist.getMutex());
-		const PlaylistItem& track = m_playlist.getTrack(uuid);
+		std::shared_ptr<const PlaylistSnapshot> playlist = m_playlist.getSnapshot();
+		const PlaylistItem& track = playlist->getTrack(track_id(uuid));
 		path = track.getPath();
 	} catch (std::runtime_error& e) {
 		Json::Value json;
@@ -516,60 +1155,49 @@ int Webserver::GET_subs(struct MHD_Connection* connection, const std::string& uu
 		return mhd_queue_json(connection, 500, json);
 	}
 
-	std::string time = std::to_string(startTime);
-	std::vector<const char*> cbuf;
-	cbuf.push_back(ffmpegpath());
-	cbuf.push_back("-y");
-	if (startTime) {
-		cbuf.push_back("-ss"); cbuf.push_back(time.c_str());
-	}
-	std::string subs = path;
-	std::string subs_encoding;
-	if (subs.find_last_of(".") != std::string::npos) {
-		subs.erase(subs.find_last_of("."), std::string::npos);
-		subs += ".srt";
-		if (access(subs.c_str(), F_OK) == 0) {
-			path = subs;
-			std::string encoding = execvp({"file", "-bI", subs});
-			if (encoding.find("charset=") != std::string::npos) {
-				encoding.erase(0, encoding.find("charset=") + 8);
-				encoding.erase(encoding.find_last_not_of(" \r\n") + 1);
-				subs_encoding = encoding;
+	// shifted the same as the stream, which starts at a keyframe
+	double start = m_keyframes.snap(path, startTime);
+
+	// ?track=n is the n:th embedded subtitle stream, otherwise the sidecar
+	// SubRip file (converted in-process, once, then shifted)
+	const char* stream = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "track");
+	if (!stream) {
+		std::string subs = subtitles_sidecar(path);
+		if (!subs.empty()) {
+			try {
+				std::shared_ptr<const SubtitleTrack> track = m_subtitles.get(subs);
+				return mhd_queue_vtt(connection, subtitles_webvtt(*track, (int64_t)(start * 1000)));
+			} catch (std::runtime_error& e) {
+				syslog(LOG_ERR, "Could not read subtitles from %s: %s", subs.c_str(), e.what());
 			}
-			syslog(LOG_DEBUG, "Reading subtitles from %s (%s)", subs.c_str(), subs_encoding.c_str());
 		}
 	}
-	if (!subs_encoding.empty()) {
-		cbuf.push_back("-sub_charenc"); cbuf.push_back(subs_encoding.c_str());
-	}
-	cbuf.push_back("-i"); cbuf.push_back(path.c_str());
-	cbuf.push_back("-vn");
-	cbuf.push_back("-an");
-	cbuf.push_back("-scodec"); cbuf.push_back("webvtt");
-	cbuf.push_back("-f"); cbuf.push_back("webvtt");
-	cbuf.push_back("-");
-	cbuf.push_back(0);
-
-	std::string cmd;
-	for (auto i: cbuf) { if (i != cbuf[0]) cmd += " "; if (i) cmd += i; }
-	syslog(LOG_DEBUG, "Command: %s", cmd.c_str());
-
-	int mypipe[2];
-	pipe(mypipe);
-	pid_t pid = fork();
-	if (pid == (pid_t)0)
-	{
-		close(mypipe[0]);
-		close(fileno(stderr));
-		dup2(mypipe[1], fileno(stdout));
-		execvp(cbuf[0], (char* const*)&cbuf[0]);
-		_exit(1);
-	}
-	close(mypipe[1]);
-	mhd_forkctx* f = new mhd_forkctx;
-	f->pid = pid;
-	f->fd = mypipe[0];
-	MHD_Response* response = MHD_create_response_from_callback(-1, 8192, &mhd_forkctx_read, f, &mhd_forkctx_clean);
+
+	// embedded streams are extracted in the background (all of them at once),
+	// give it a moment before falling back to an ffmpeg of our own
+	unsigned int index = stream ? strtoul(stream, NULL, 10) : 0;
+	std::shared_ptr<const SubtitleTrack> track = m_subtitles.wait(path, index, 5);
+	if (track)
+		return mhd_queue_vtt(connection, subtitles_webvtt(*track, (int64_t)(start * 1000)));
+
+	std::vector<std::string> args;
+	args.push_back(ffmpegpath());
+	args.push_back("-y");
+	if (start > 0) {
+		args.push_back("-ss"); args.push_back(std::to_string(start));
+	}
+	args.push_back("-i"); args.push_back(path);
+	if (stream) {
+		args.push_back("-map"); args.push_back("0:s:" + std::to_string(index));
+	}
+	args.push_back("-vn");
+	args.push_back("-an");
+	args.push_back("-scodec"); args.push_back("webvtt");
+	args.push_back("-f"); args.push_back("webvtt");
+	args.push_back("-");
+
+	mhd_transcoderctx* t = mhd_transcoderctx_create(new ProcessTranscoder(args));
+	MHD_Response* response = MHD_create_response_from_callback(-1, 8192, &mhd_transcoder_read, t, &mhd_transcoder_clean);
 	MHD_add_response_header(response, "Content-Type", "text/vtt;charset=utf-8");
 	MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
 	int ret = MHD_queue_response(connection,
@@ -579,51 +1207,231 @@ int Webserver::GET_subs(struct MHD_Connection* connection, const std::string& uu
 	return ret;
 }
 
+static Json::Value progress_json(const TranscodeProgress& progress)
+{
+	Json::Value json;
+	json["fps"] = progress.fps;
+	json["speed"] = progress.speed;
+	json["bitrate"] = progress.bitrate;
+	json["bytes"] = (Json::UInt64)progress.bytes;
+	json["time"] = progress.time;
+	json["slow"] = progress.slow;
+	return json;
+}
+
 int Webserver::GET_streaminfo(struct MHD_Connection* connection)
 {
-	std::lock_guard<std::mutex> lock(m_playlist.getMutex());
+	std::map<std::string, TranscodeProgress> progress = m_supervisor.getProgress();
 
 	Json::Value json;
 	json["uuid"] = m_sender.getUUID();
 	json["playerstate"] = m_sender.getPlayerState();
 	json["currenttime"] = m_seek + m_sender.getPlayerCurrentTime();
+	json["seek"] = m_seek;
 	json["subtitles"] = m_sender.hasSubtitles();
-	json["playlist"] = m_playlist.getUUID();
+	json["subtitletrack"] = m_sender.getSubtitleTrack();
+	json["playlist"] = (Json::UInt64)m_playlist.getSnapshot()->getVersion();
 	json["volume"] = m_sender.getVolume();
 	json["muted"] = m_sender.getMuted();
+
+	// the transcode of what is playing, its key starts with the uuid
+	std::string prefix = m_sender.getUUID() + "/";
+	for (auto& item : progress)
+		if (item.first.compare(0, prefix.size(), prefix) == 0)
+			json["transcode"] = progress_json(item.second);
 	return mhd_queue_json(connection, MHD_HTTP_OK, json);
 }
 
-std::string execvp(const std::vector<std::string>& args, bool _stdin)
+int Webserver::GET_metrics(struct MHD_Connection* connection)
+{
+	Json::Value json = metrics_json();
+	json["streams"] = Json::Value(Json::objectValue);
+	for (auto& item : m_supervisor.getProgress())
+		json["streams"][item.first] = progress_json(item.second);
+	return mhd_queue_json(connection, MHD_HTTP_OK, json);
+}
+
+struct mhd_segmentctx
+{
+	std::shared_ptr<const std::string> data;
+};
+
+void mhd_segmentctx_clean(void* cls)
+{
+	delete static_cast<mhd_segmentctx*>(cls);
+}
+
+ssize_t mhd_segmentctx_read(void* cls, uint64_t pos, char* buf, size_t max)
+{
+	mhd_segmentctx* s = static_cast<mhd_segmentctx*>(cls);
+	if (pos >= s->data->size())
+		return MHD_CONTENT_READER_END_OF_STREAM;
+	size_t len = std::min(max, (size_t)(s->data->size() - pos));
+	memcpy(buf, s->data->data() + pos, len);
+	return len;
+}
+
+int Webserver::GET_hls(struct MHD_Connection* connection, const std::string& uuid, const std::string& file)
 {
-	std::vector<const char*> cbuf;
-	for (auto& a : args)
-		cbuf.push_back(a.c_str());
-	cbuf.push_back(0);
+	std::shared_ptr<const std::string> data;
+	if (file == "index.m3u8") {
+		std::string path;
+		try {
+			std::shared_ptr<const PlaylistSnapshot> playlist = m_playlist.getSnapshot();
+			const PlaylistItem& track = playlist->getTrack(track_id(uuid));
+			path = track.getPath();
+		} catch (std::runtime_error& e) {
+			Json::Value json;
+			json["error"] = e.what();
+			return mhd_queue_json(connection, 500, json);
+		}
+		startHls(uuid, path);
+		data = m_segments.wait(uuid + "/" + file, 30);
+	} else
+		data = m_segments.get(uuid + "/" + file);
+	if (!data)
+		return mhd_queue_json(connection, MHD_HTTP_NOT_FOUND, Json::Value());
+
+	std::string contentType = "video/mp2t";
+	if (file.find(".m3u8") != std::string::npos)
+		contentType = "application/x-mpegURL";
+	else if (file.find(".m4s") != std::string::npos || file.find(".mp4") != std::string::npos)
+		contentType = "video/mp4";
+
+	mhd_segmentctx* s = new mhd_segmentctx;
+	s->data = data;
+	MHD_Response* response = MHD_create_response_from_callback(data->size(), 65536, &mhd_segmentctx_read, s, &mhd_segmentctx_clean);
+	MHD_add_response_header(response, "Content-Type", contentType.c_str());
+	MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+	if (contentType == "application/x-mpegURL")
+		MHD_add_response_header(response, "Cache-Control", "no-cache");
+	int ret = MHD_queue_response(connection,
+			MHD_HTTP_OK,
+			response);
+	MHD_destroy_response(response);
+	return ret;
+}
+
+int Webserver::PUT_hls(struct MHD_Connection* connection, const std::string& uuid, const std::string& file, const std::string& data)
+{
+	// only our own ffmpeg jobs may upload segments
+	if (!isPrivileged(connection))
+		return mhd_queue_json(connection, 403, Json::Value());
+
+	m_segments.put(uuid + "/" + file, data);
+	return mhd_queue_json(connection, MHD_HTTP_CREATED, Json::Value());
+}
 
-	int mypipe[2];
-	pipe(mypipe);
-	pid_t pid = fork();
-	if (pid == (pid_t)0)
+// start a HLS job for uuid (unless one is already running or a complete set
+// of segments is available). ffmpeg uploads the playlist and segments back to
+// us using PUT requests. jobs of other tracks are stopped once nobody has read
+// their segments for a while, the set of one that finished stays until the
+// store evicts it.
+void Webserver::startHls(const std::string& uuid, const std::string& path)
+{
 	{
-		close(mypipe[0]);
-		if (_stdin) {
-			close(fileno(stderr));
-			dup2(mypipe[1], fileno(stdout));
-		} else {
-			close(fileno(stdout));
-			dup2(mypipe[1], fileno(stderr));
+		std::lock_guard<std::mutex> lock(m_hls_mutex);
+
+		bool running = false;
+		for (auto i = m_hls_jobs.begin(); i != m_hls_jobs.end();) {
+			// -1 is a job that is being started
+			if (i->second < 0 || (process_running(i->second) &&
+						(i->first == uuid || m_segments.idle(i->first) < HlsIdleSeconds))) {
+				running = running || i->first == uuid;
+				++i;
+				continue;
+			}
+			m_segments.pin(i->first, false);
+			if (process_running(i->second)) {
+				// a partial set nobody reads
+				syslog(LOG_DEBUG, "Stopping HLS job for %s", i->first.c_str());
+				process_kill(i->second);
+				m_segments.remove(i->first);
+			}
+			process_wait(i->second);
+			i = m_hls_jobs.erase(i);
 		}
-		execvp(cbuf[0], (char* const*)&cbuf[0]);
-		_exit(1);
-	}
-	close(mypipe[1]);
-	char buf[1024];
-	int r;
-	std::string result;
-	while ((r = read(mypipe[0], buf, sizeof buf)) > 0)
-		result.append(buf, r);
-	waitpid(pid, &r, 0);
-	close(mypipe[0]);
-	return result;
+		if (running)
+			return;
+
+		std::shared_ptr<const std::string> index = m_segments.get(uuid + "/index.m3u8");
+		if (index && index->find("#EXT-X-ENDLIST") != std::string::npos) {
+			bool complete = true;
+			std::string::size_type pos = 0;
+			while (complete && pos < index->size()) {
+				std::string::size_type eol = index->find('\n', pos);
+				if (eol == std::string::npos)
+					eol = index->size();
+				std::string line = index->substr(pos, eol - pos);
+				line.erase(line.find_last_not_of(" \r") + 1);
+				if (!line.empty() && line[0] != '#')
+					complete = m_segments.contains(uuid + "/" + line);
+				else if (line.find("#EXT-X-MAP:URI=\"") == 0)
+					complete = m_segments.contains(uuid + "/" + line.substr(16, line.find('"', 16) - 16));
+				pos = eol + 1;
+			}
+			if (complete) {
+				syslog(LOG_DEBUG, "Reusing HLS segments for %s", uuid.c_str());
+				return;
+			}
+		}
+
+		// the segments of a job that died are overwritten as the new one
+		// gets to them, a receiver may still be playing them
+		m_hls_jobs[uuid] = -1;
+		m_segments.pin(uuid, true);
+	}
+
+	// ffprobe would hold up every other HLS request under the lock
+	std::string vcodec = probe_vcodec(probe(path));
+	std::string base = "http://127.0.0.1:" + std::to_string(m_port) + "/hls/" + uuid + "/";
+	std::string segments = base + (m_hls_type == "fmp4" ? "%d.m4s" : "%d.ts");
+	std::string playlist = base + "index.m3u8";
+	std::vector<std::string> args;
+	args.push_back(ffmpegpath());
+	args.push_back("-y");
+	args.push_back("-i"); args.push_back(path);
+	args.push_back("-vcodec"); args.push_back(vcodec);
+	args.push_back("-acodec"); args.push_back("aac");
+	args.push_back("-strict"); args.push_back("-2");
+	args.push_back("-f"); args.push_back("hls");
+	args.push_back("-hls_time"); args.push_back("6");
+	args.push_back("-hls_list_size"); args.push_back("0");
+	args.push_back("-hls_playlist_type"); args.push_back("event");
+	if (m_hls_type == "fmp4") {
+		args.push_back("-hls_segment_type"); args.push_back("fmp4");
+		args.push_back("-hls_fmp4_init_filename"); args.push_back("init.mp4");
+	} else {
+		args.push_back("-hls_segment_type"); args.push_back("mpegts");
+	}
+	args.push_back("-method"); args.push_back("PUT");
+	args.push_back("-hls_segment_filename"); args.push_back(segments);
+	args.push_back(playlist);
+
+	std::lock_guard<std::mutex> lock(m_hls_mutex);
+	auto job = m_hls_jobs.find(uuid);
+	// stopped meanwhile
+	if (job == m_hls_jobs.end() || job->second >= 0)
+		return;
+	pid_t pid = process_spawn(args);
+	if (pid < 0) {
+		syslog(LOG_ERR, "Could not start the HLS job for %s", uuid.c_str());
+		m_segments.pin(uuid, false);
+		m_hls_jobs.erase(job);
+		return;
+	}
+	job->second = pid;
+	m_seek = 0;
+}
+
+void Webserver::stopHls()
+{
+	std::lock_guard<std::mutex> lock(m_hls_mutex);
+	for (auto& job : m_hls_jobs) {
+		if (job.second < 0)
+			continue;
+		process_kill(job.second);
+		process_wait(job.second);
+	}
+	m_hls_jobs.clear();
 }
@@ -3,16 +3,42 @@
 
 #include "playlist.hpp"
 #include "chromecast.hpp"
+#include "segmentstore.hpp"
+#include "supervisor.hpp"
+#include "subtitles.hpp"
+#include "keyframes.hpp"
 #include <microhttpd.h>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include <functional>
 
 class Webserver {
 	public:
 		Webserver(unsigned short port, ChromeCast& sender, Playlist& playlist);
 		~Webserver();
 
+		bool load(const std::string& uuid, const std::string& name, time_t startTime = 0);
+		void setHlsSegmentType(const std::string& type);
+		static bool isHlsSegmentType(const std::string& type);
+		void setHlsMemoryLimit(size_t bytes);
+		void setTranscodeWorkers(unsigned int workers);
+		void setChunkSize(unsigned int seconds);
+		void setEngine(const std::string& engine);
+		static bool isEngine(const std::string& engine);
+		void setMaxStreams(unsigned int streams);
+		void setReadAhead(size_t bytes, unsigned int seconds);
+		void setZeroCopy(bool value);
+		void setPrefetch(unsigned int seconds);
+		void setGapless(unsigned int preloadTime);
+		void setStallTimeout(unsigned int seconds);
+		void setIndexDirectory(const std::string& dir);
+		void mediaStatus(const std::string& playerState, const std::string& idleReason, const std::string& uuid);
 	private:
 		int GET_file(struct MHD_Connection* connection, const std::string& file, const std::string& contentType);
 		int POST_playlist(struct MHD_Connection* connection, const std::string& data);
+		int POST_playlist_apply(struct MHD_Connection* connection, const std::string& data);
 		int DELETE_playlist(struct MHD_Connection* connection, const std::string& uuid);
 		int GET_playlist(struct MHD_Connection* connection);
 		int GET_playlist_repeat(struct MHD_Connection* connection, bool value);
@@ -21,15 +47,33 @@ class Webserver {
 		int GET_pause(struct MHD_Connection* connection);
 		int GET_resume(struct MHD_Connection* connection);
 		int GET_stop(struct MHD_Connection* connection);
-		int GET_subtitles(struct MHD_Connection* connection, bool value);
+		int GET_subtitles(struct MHD_Connection* connection, unsigned int trackId);
 		int GET_volume(struct MHD_Connection* connection, double volume);
 		int GET_muted(struct MHD_Connection* connection, bool value);
 		int GET_play(struct MHD_Connection* connection, const std::string& uuid, time_t startTime = 0);
 		int GET_queue(struct MHD_Connection* connection, const std::string& uuid);
 		int GET_next(struct MHD_Connection* connection);
 		int GET_stream(struct MHD_Connection* connection, const std::string& uuid, time_t startTime = 0);
+		int GET_stream_zerocopy(struct MHD_Connection* connection, const std::string& path, double startTime);
 		int GET_subs(struct MHD_Connection* connection, const std::string& uuid, time_t startTime = 0);
 		int GET_streaminfo(struct MHD_Connection* connection);
+		int GET_metrics(struct MHD_Connection* connection);
+		int GET_hls(struct MHD_Connection* connection, const std::string& uuid, const std::string& file);
+		int PUT_hls(struct MHD_Connection* connection, const std::string& uuid, const std::string& file, const std::string& data);
+
+		Transcoder* createTranscoder(const std::string& path, double startTime);
+		std::string streamKey(const std::string& uuid, double startTime) const;
+		void prefetch(const std::string& uuid);
+		// runs task on the worker thread, delay seconds from now
+		void post(const std::function<void()>& task, unsigned int delay = 0);
+		void worker();
+		ChromeCast::Media createMedia(const std::string& uuid, const std::string& name,
+				const std::string& path, time_t startTime);
+		void playNext(const std::string& uuid);
+		void restartStalled(const std::string& key, double stalled);
+		void syncQueue();
+		void startHls(const std::string& uuid, const std::string& path);
+		void stopHls();
 
 		bool isPrivileged(struct MHD_Connection* connection);
 
@@ -55,6 +99,39 @@ class Webserver {
 		ChromeCast& m_sender;
 		Playlist& m_playlist;
 		double m_seek;
+		unsigned int m_workers;
+		unsigned int m_chunk_size;
+		std::string m_engine;
+		Supervisor m_supervisor;
+		bool m_zero_copy;
+		// a spliced stream ends once the client takes no data for this long
+		enum { ZeroCopySendTimeout = 30 };
+		unsigned int m_prefetch_seconds;
+		// what is done in the background (anything that talks to the
+		// receiver or waits first) runs on m_worker by its time, the
+		// thread is joined on destruction
+		std::thread m_worker;
+		std::multimap<std::chrono::steady_clock::time_point, std::function<void()>> m_tasks;
+		bool m_stopping;
+		std::mutex m_worker_mutex;
+		std::condition_variable m_worker_cond;
+
+		unsigned int m_preload;
+		std::string m_current;
+		std::string m_queued;
+		bool m_gap_pending;
+		std::chrono::steady_clock::time_point m_track_ended;
+		std::mutex m_queue_mutex;
+
+		SegmentStore m_segments;
+		SubtitleCache m_subtitles;
+		KeyframeIndex m_keyframes;
+		std::string m_hls_type;
+		// a job nobody read from for this long is stopped for another track
+		enum { HlsIdleSeconds = 60 };
+		// by uuid, -1 while it is being started
+		std::map<std::string, pid_t> m_hls_jobs;
+		std::mutex m_hls_mutex;
 
 		short int m_port;
 		struct MHD_Daemon* mp_d;
@@ -0,0 +1,41 @@
+#include "zerocopy.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+uint64_t zerocopy_transfer(int in, int out)
+{
+	uint64_t total = 0;
+#ifdef SPLICE_F_MOVE
+	while (true)
+	{
+		ssize_t r = splice(in, NULL, out, NULL, 1024 * 1024, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (r > 0) {
+			total += r;
+			continue;
+		}
+		if (r == 0)
+			return total;
+		if (errno == EINTR)
+			continue;
+		// not supported for these fds, fall back to copying
+		if (errno == EINVAL && total == 0)
+			break;
+		return total;
+	}
+#endif
+	char buf[65536];
+	ssize_t r;
+	while ((r = read(in, buf, sizeof buf)) > 0)
+	{
+		ssize_t w = 0;
+		while (w < r) {
+			ssize_t n = write(out, buf + w, r - w);
+			if (n <= 0)
+				return total;
+			w += n;
+		}
+		total += r;
+	}
+	return total;
+}
@@ -0,0 +1,11 @@
+#ifndef _ZEROCOPY_HPP_
+#define _ZEROCOPY_HPP_
+
+#include <stdint.h>
+
+// move everything from the pipe in to the socket out, with splice(2) where
+// available (the data never enters user space), otherwise read/write.
+// returns the number of bytes transferred.
+uint64_t zerocopy_transfer(int in, int out);
+
+#endif